@@ -0,0 +1,256 @@
+#pragma charmap (0x00,0x00)
+#pragma charmap (0x01,0x01)
+#pragma charmap (0x02,0x02)
+#pragma charmap (0x03,0x03)
+#pragma charmap (0x04,0x04)
+#pragma charmap (0x05,0x05)
+#pragma charmap (0x06,0x06)
+#pragma charmap (0x07,0x07)
+#pragma charmap (0x08,0x08)
+#pragma charmap (0x09,0x09)
+#pragma charmap (0x0a,0x0a)
+#pragma charmap (0x0b,0x0b)
+#pragma charmap (0x0c,0x0c)
+#pragma charmap (0x0d,0x0d)
+#pragma charmap (0x0e,0x0e)
+#pragma charmap (0x0f,0x0f)
+#pragma charmap (0x10,0x10)
+#pragma charmap (0x11,0x11)
+#pragma charmap (0x12,0x12)
+#pragma charmap (0x13,0x13)
+#pragma charmap (0x14,0x14)
+#pragma charmap (0x15,0x15)
+#pragma charmap (0x16,0x16)
+#pragma charmap (0x17,0x17)
+#pragma charmap (0x18,0x18)
+#pragma charmap (0x19,0x19)
+#pragma charmap (0x1a,0x1a)
+#pragma charmap (0x1b,0x1b)
+#pragma charmap (0x1c,0x1c)
+#pragma charmap (0x1d,0x1d)
+#pragma charmap (0x1e,0x1e)
+#pragma charmap (0x1f,0x1f)
+#pragma charmap (0x20,0x20)
+#pragma charmap (0x21,0x21)
+#pragma charmap (0x22,0x22)
+#pragma charmap (0x23,0x23)
+#pragma charmap (0x24,0x24)
+#pragma charmap (0x25,0x25)
+#pragma charmap (0x26,0x26)
+#pragma charmap (0x27,0x27)
+#pragma charmap (0x28,0x28)
+#pragma charmap (0x29,0x29)
+#pragma charmap (0x2a,0x2a)
+#pragma charmap (0x2b,0x2b)
+#pragma charmap (0x2c,0x2c)
+#pragma charmap (0x2d,0x2d)
+#pragma charmap (0x2e,0x2e)
+#pragma charmap (0x2f,0x2f)
+#pragma charmap (0x30,0x30)
+#pragma charmap (0x31,0x31)
+#pragma charmap (0x32,0x32)
+#pragma charmap (0x33,0x33)
+#pragma charmap (0x34,0x34)
+#pragma charmap (0x35,0x35)
+#pragma charmap (0x36,0x36)
+#pragma charmap (0x37,0x37)
+#pragma charmap (0x38,0x38)
+#pragma charmap (0x39,0x39)
+#pragma charmap (0x3a,0x3a)
+#pragma charmap (0x3b,0x3b)
+#pragma charmap (0x3c,0x3c)
+#pragma charmap (0x3d,0x3d)
+#pragma charmap (0x3e,0x3e)
+#pragma charmap (0x3f,0x3f)
+#pragma charmap (0x40,0x40)
+#pragma charmap (0x41,0x41)
+#pragma charmap (0x42,0x42)
+#pragma charmap (0x43,0x43)
+#pragma charmap (0x44,0x44)
+#pragma charmap (0x45,0x45)
+#pragma charmap (0x46,0x46)
+#pragma charmap (0x47,0x47)
+#pragma charmap (0x48,0x48)
+#pragma charmap (0x49,0x49)
+#pragma charmap (0x4a,0x4a)
+#pragma charmap (0x4b,0x4b)
+#pragma charmap (0x4c,0x4c)
+#pragma charmap (0x4d,0x4d)
+#pragma charmap (0x4e,0x4e)
+#pragma charmap (0x4f,0x4f)
+#pragma charmap (0x50,0x50)
+#pragma charmap (0x51,0x51)
+#pragma charmap (0x52,0x52)
+#pragma charmap (0x53,0x53)
+#pragma charmap (0x54,0x54)
+#pragma charmap (0x55,0x55)
+#pragma charmap (0x56,0x56)
+#pragma charmap (0x57,0x57)
+#pragma charmap (0x58,0x58)
+#pragma charmap (0x59,0x59)
+#pragma charmap (0x5a,0x5a)
+#pragma charmap (0x5b,0x5b)
+#pragma charmap (0x5c,0x5c)
+#pragma charmap (0x5d,0x5d)
+#pragma charmap (0x5e,0x5e)
+#pragma charmap (0x5f,0x5f)
+#pragma charmap (0x60,0x60)
+#pragma charmap (0x61,0x61)
+#pragma charmap (0x62,0x62)
+#pragma charmap (0x63,0x63)
+#pragma charmap (0x64,0x64)
+#pragma charmap (0x65,0x65)
+#pragma charmap (0x66,0x66)
+#pragma charmap (0x67,0x67)
+#pragma charmap (0x68,0x68)
+#pragma charmap (0x69,0x69)
+#pragma charmap (0x6a,0x6a)
+#pragma charmap (0x6b,0x6b)
+#pragma charmap (0x6c,0x6c)
+#pragma charmap (0x6d,0x6d)
+#pragma charmap (0x6e,0x6e)
+#pragma charmap (0x6f,0x6f)
+#pragma charmap (0x70,0x70)
+#pragma charmap (0x71,0x71)
+#pragma charmap (0x72,0x72)
+#pragma charmap (0x73,0x73)
+#pragma charmap (0x74,0x74)
+#pragma charmap (0x75,0x75)
+#pragma charmap (0x76,0x76)
+#pragma charmap (0x77,0x77)
+#pragma charmap (0x78,0x78)
+#pragma charmap (0x79,0x79)
+#pragma charmap (0x7a,0x7a)
+#pragma charmap (0x7b,0x7b)
+#pragma charmap (0x7c,0x7c)
+#pragma charmap (0x7d,0x7d)
+#pragma charmap (0x7e,0x7e)
+#pragma charmap (0x7f,0x7f)
+#pragma charmap (0x80,0x80)
+#pragma charmap (0x81,0x81)
+#pragma charmap (0x82,0x82)
+#pragma charmap (0x83,0x83)
+#pragma charmap (0x84,0x84)
+#pragma charmap (0x85,0x85)
+#pragma charmap (0x86,0x86)
+#pragma charmap (0x87,0x87)
+#pragma charmap (0x88,0x88)
+#pragma charmap (0x89,0x89)
+#pragma charmap (0x8a,0x8a)
+#pragma charmap (0x8b,0x8b)
+#pragma charmap (0x8c,0x8c)
+#pragma charmap (0x8d,0x8d)
+#pragma charmap (0x8e,0x8e)
+#pragma charmap (0x8f,0x8f)
+#pragma charmap (0x90,0x90)
+#pragma charmap (0x91,0x91)
+#pragma charmap (0x92,0x92)
+#pragma charmap (0x93,0x93)
+#pragma charmap (0x94,0x94)
+#pragma charmap (0x95,0x95)
+#pragma charmap (0x96,0x96)
+#pragma charmap (0x97,0x97)
+#pragma charmap (0x98,0x98)
+#pragma charmap (0x99,0x99)
+#pragma charmap (0x9a,0x9a)
+#pragma charmap (0x9b,0x9b)
+#pragma charmap (0x9c,0x9c)
+#pragma charmap (0x9d,0x9d)
+#pragma charmap (0x9e,0x9e)
+#pragma charmap (0x9f,0x9f)
+#pragma charmap (0xa0,0xa0)
+#pragma charmap (0xa1,0xa1)
+#pragma charmap (0xa2,0xa2)
+#pragma charmap (0xa3,0xa3)
+#pragma charmap (0xa4,0xa4)
+#pragma charmap (0xa5,0xa5)
+#pragma charmap (0xa6,0xa6)
+#pragma charmap (0xa7,0xa7)
+#pragma charmap (0xa8,0xa8)
+#pragma charmap (0xa9,0xa9)
+#pragma charmap (0xaa,0xaa)
+#pragma charmap (0xab,0xab)
+#pragma charmap (0xac,0xac)
+#pragma charmap (0xad,0xad)
+#pragma charmap (0xae,0xae)
+#pragma charmap (0xaf,0xaf)
+#pragma charmap (0xb0,0xb0)
+#pragma charmap (0xb1,0xb1)
+#pragma charmap (0xb2,0xb2)
+#pragma charmap (0xb3,0xb3)
+#pragma charmap (0xb4,0xb4)
+#pragma charmap (0xb5,0xb5)
+#pragma charmap (0xb6,0xb6)
+#pragma charmap (0xb7,0xb7)
+#pragma charmap (0xb8,0xb8)
+#pragma charmap (0xb9,0xb9)
+#pragma charmap (0xba,0xba)
+#pragma charmap (0xbb,0xbb)
+#pragma charmap (0xbc,0xbc)
+#pragma charmap (0xbd,0xbd)
+#pragma charmap (0xbe,0xbe)
+#pragma charmap (0xbf,0xbf)
+#pragma charmap (0xc0,0xc0)
+#pragma charmap (0xc1,0xc1)
+#pragma charmap (0xc2,0xc2)
+#pragma charmap (0xc3,0xc3)
+#pragma charmap (0xc4,0xc4)
+#pragma charmap (0xc5,0xc5)
+#pragma charmap (0xc6,0xc6)
+#pragma charmap (0xc7,0xc7)
+#pragma charmap (0xc8,0xc8)
+#pragma charmap (0xc9,0xc9)
+#pragma charmap (0xca,0xca)
+#pragma charmap (0xcb,0xcb)
+#pragma charmap (0xcc,0xcc)
+#pragma charmap (0xcd,0xcd)
+#pragma charmap (0xce,0xce)
+#pragma charmap (0xcf,0xcf)
+#pragma charmap (0xd0,0xd0)
+#pragma charmap (0xd1,0xd1)
+#pragma charmap (0xd2,0xd2)
+#pragma charmap (0xd3,0xd3)
+#pragma charmap (0xd4,0xd4)
+#pragma charmap (0xd5,0xd5)
+#pragma charmap (0xd6,0xd6)
+#pragma charmap (0xd7,0xd7)
+#pragma charmap (0xd8,0xd8)
+#pragma charmap (0xd9,0xd9)
+#pragma charmap (0xda,0xda)
+#pragma charmap (0xdb,0xdb)
+#pragma charmap (0xdc,0xdc)
+#pragma charmap (0xdd,0xdd)
+#pragma charmap (0xde,0xde)
+#pragma charmap (0xdf,0xdf)
+#pragma charmap (0xe0,0xe0)
+#pragma charmap (0xe1,0xe1)
+#pragma charmap (0xe2,0xe2)
+#pragma charmap (0xe3,0xe3)
+#pragma charmap (0xe4,0xe4)
+#pragma charmap (0xe5,0xe5)
+#pragma charmap (0xe6,0xe6)
+#pragma charmap (0xe7,0xe7)
+#pragma charmap (0xe8,0xe8)
+#pragma charmap (0xe9,0xe9)
+#pragma charmap (0xea,0xea)
+#pragma charmap (0xeb,0xeb)
+#pragma charmap (0xec,0xec)
+#pragma charmap (0xed,0xed)
+#pragma charmap (0xee,0xee)
+#pragma charmap (0xef,0xef)
+#pragma charmap (0xf0,0xf0)
+#pragma charmap (0xf1,0xf1)
+#pragma charmap (0xf2,0xf2)
+#pragma charmap (0xf3,0xf3)
+#pragma charmap (0xf4,0xf4)
+#pragma charmap (0xf5,0xf5)
+#pragma charmap (0xf6,0xf6)
+#pragma charmap (0xf7,0xf7)
+#pragma charmap (0xf8,0xf8)
+#pragma charmap (0xf9,0xf9)
+#pragma charmap (0xfa,0xfa)
+#pragma charmap (0xfb,0xfb)
+#pragma charmap (0xfc,0xfc)
+#pragma charmap (0xfd,0xfd)
+#pragma charmap (0xfe,0xfe)
+#pragma charmap (0xff,0xff)
@@ -19,11 +19,17 @@
 
 */
 
+#ifndef __CC65__
+// For O_DIRECT
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #ifndef __CC65__
 #include <unistd.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #endif
@@ -32,6 +38,11 @@
 #include "fdisk_memory.h"
 #include "fdisk_screen.h"
 #include "fdisk_fat32.h"
+#include "fdisk_known.h"
+#include "fdisk_speedtest.h"
+#include "fdisk_trace.h"
+#include "fdisk_wcache.h"
+#include "fdisk_progress.h"
 #include "ascii.h"
 
 unsigned char slot_magic[16] = { 0x4d, 0x45, 0x47, 0x41, 0x36, 0x35, 0x42, 0x49, 0x54, 0x53, 0x54, 0x52, 0x45, 0x41, 0x4d,
@@ -54,6 +65,66 @@ unsigned char dont_confirm = 0;
 
 uint8_t sector_buffer[512];
 
+#ifndef __CC65__
+// Bytes per sdcard_writesectors() call when copying host files
+#define COPY_BUFFER_BYTES (1024 * 1024)
+
+struct option long_options[] = { { "device", required_argument, 0, 'd' }, { "io", required_argument, 0, 'i' },
+  { "size", required_argument, 0, 's' }, { "bench", no_argument, 0, 'b' },
+  { "trace", required_argument, 0, 't' }, { "manifest", required_argument, 0, 'm' }, { 0, 0, 0, 0 } };
+
+// Run the SD card benchmarks instead of formatting (see --bench)
+unsigned char benchmark = 0;
+
+void usage(void)
+{
+  fprintf(stderr, "usage: m65fdisk [--device <path>] [--io buffered|sync|direct] [--size <bytes>[K|M|G|T]] [--bench]\n"
+                  "                [--trace <file>] [--manifest <file>] [file ...]\n"
+                  "  --device Block device or image file to format (default /dev/sdb).\n"
+                  "  --io     Open the device with buffered (default), O_SYNC or O_DIRECT I/O.\n"
+                  "  --size   Use this size instead of the size of the image or device.\n"
+                  "           Image files smaller than this are created or extended.\n"
+                  "  --bench  Benchmark the device instead of formatting it. This overwrites\n"
+                  "           sectors 1 - 2047, so it refuses when a partition starts there.\n"
+                  "  --trace  Record all sector I/O in <file>, for m65fdisk-replay.\n"
+                  "  --manifest\n"
+                  "           Also copy the files listed in <file>, one per line, as\n"
+                  "           <source> [<destination>]. Lines starting with # are ignored.\n"
+                  "Files are put in the same (relative) directory on the card as on the host,\n"
+                  "or given as <destination>, and directories are created as needed.\n");
+  exit(-1);
+}
+
+uint64_t parse_size(const char *arg)
+{
+  char *end;
+  uint64_t size = strtoull(arg, &end, 0);
+
+  switch (*end) {
+  case 't':
+  case 'T':
+    size <<= 10;
+  case 'g':
+  case 'G':
+    size <<= 10;
+  case 'm':
+  case 'M':
+    size <<= 10;
+  case 'k':
+  case 'K':
+    size <<= 10;
+    end++;
+  }
+  if (*end || !size) {
+    fprintf(stderr, "Invalid size '%s'\n", arg);
+    usage();
+  }
+
+  // Whole sectors only
+  return size & ~511ULL;
+}
+#endif
+
 void clear_sector_buffer(void)
 {
 #ifndef __CC65__DONTUSE
@@ -474,19 +545,19 @@ void show_partition_entry(const char i)
     ((char *)&lba_end)[j] = sector_buffer[offset + 12 + j];
 
 #ifdef __CC65__
-  format_hex((int)report + 0, id, 2);
+  format_hex((unsigned int)report + 0, id, 2);
   if (!(active & 0x80))
     report[2] = ' '; // not active
 
-  format_decimal((int)report + 12, shead, 3);
-  format_decimal((int)report + 16, ssector, 2);
-  format_decimal((int)report + 19, scylinder, 4);
-  format_hex((int)report + 27, lba_start, 8);
+  format_decimal((unsigned int)report + 12, shead, 3);
+  format_decimal((unsigned int)report + 16, ssector, 2);
+  format_decimal((unsigned int)report + 19, scylinder, 4);
+  format_hex((unsigned int)report + 27, lba_start, 8);
 
-  format_decimal((int)report + 42, ehead, 3);
-  format_decimal((int)report + 46, esector, 2);
-  format_decimal((int)report + 49, ecylinder, 4);
-  format_hex((int)report + 57, lba_end, 8);
+  format_decimal((unsigned int)report + 42, ehead, 3);
+  format_decimal((unsigned int)report + 46, esector, 2);
+  format_decimal((unsigned int)report + 49, ecylinder, 4);
+  format_hex((unsigned int)report + 57, lba_end, 8);
 
   write_line(report, 2);
 #else
@@ -495,11 +566,108 @@ void show_partition_entry(const char i)
 #endif
 }
 
-void show_mbr(void)
+// What we found out about the card on each bus while detecting, so that the
+// selected card does not have to be probed all over again. Only dropped when
+// rescanning, moving on to the next card, or when the card fails to reset.
+struct card_probe {
+  unsigned char valid;
+  uint32_t sectors;
+  uint16_t speed;
+  uint8_t partition_table[66]; // MBR bytes $1BE - $1FF
+} card_probe[2];
+
+void forget_cards(void)
 {
-  char i;
+  card_probe[0].valid = 0;
+  card_probe[1].valid = 0;
+  sdcard_forget_size(0);
+  sdcard_forget_size(1);
+}
 
+void snapshot_mbr(unsigned char bus)
+{
+  // Remember the partition table of the MBR in sector_buffer
+  lcopy((long)&sector_buffer[0x1be], (long)card_probe[bus].partition_table, 66);
+}
+
+void probe_card(unsigned char bus)
+{
+  // Size, speed and partition table of the (already selected) card on <bus>
+  if (card_probe[bus].valid)
+    return;
+  card_probe[bus].sectors = sdcard_getsize();
+  card_probe[bus].speed = sdcard_readspeed_test();
   sdcard_readsector(0);
+  snapshot_mbr(bus);
+  card_probe[bus].valid = 1;
+}
+
+void reset_stats(void)
+{
+  memset(&sdcard_stats, 0, sizeof(sdcard_stats));
+  dma_jobs = 0;
+  known_reads_saved = 0;
+  known_writes_elided = 0;
+  wcache_writes_absorbed = 0;
+  wcache_reads_served = 0;
+  wcache_runs = 0;
+  fat32_cache_hits = 0;
+  fat32_cache_misses = 0;
+}
+
+void show_stats(void)
+{
+  // Where the time went
+#ifdef __CC65__
+  write_line("Sectors read $         written $         erased $         flash $", 2);
+  screen_hex(screen_line_address - 80 + 2 + 14, sdcard_stats.sectors_read);
+  screen_hex(screen_line_address - 80 + 2 + 32, sdcard_stats.sectors_written);
+  screen_hex(screen_line_address - 80 + 2 + 49, sdcard_stats.sectors_erased);
+  screen_hex(screen_line_address - 80 + 2 + 65, sdcard_stats.flash_reads);
+  write_line("Writes elided $         reads saved $         verify failed $", 2);
+  screen_hex(screen_line_address - 80 + 2 + 15, known_writes_elided);
+  screen_hex(screen_line_address - 80 + 2 + 37, known_reads_saved);
+  screen_hex(screen_line_address - 80 + 2 + 61, sdcard_stats.verify_failures);
+  write_line("Retries $         resets $         DMA jobs $         busy $         ms", 2);
+  screen_hex(screen_line_address - 80 + 2 + 9, sdcard_stats.retries);
+  screen_hex(screen_line_address - 80 + 2 + 26, sdcard_stats.resets);
+  screen_hex(screen_line_address - 80 + 2 + 45, dma_jobs);
+  screen_hex(screen_line_address - 80 + 2 + 60, sdcard_stats.busy_us / 1000);
+  write_line("Cache absorbed $         writes, served $         reads in $         runs", 2);
+  screen_hex(screen_line_address - 80 + 2 + 16, wcache_writes_absorbed);
+  screen_hex(screen_line_address - 80 + 2 + 41, wcache_reads_served);
+  screen_hex(screen_line_address - 80 + 2 + 60, wcache_runs);
+  write_line("FAT cache hits $         misses $", 2);
+  screen_hex(screen_line_address - 80 + 2 + 16, fat32_cache_hits);
+  screen_hex(screen_line_address - 80 + 2 + 33, fat32_cache_misses);
+#else
+  fprintf(stderr,
+      "Sectors read %u, written %u, erased %u, read from flash %u.\n"
+      "Writes elided %u, reads saved %u, verify failures %u.\n"
+      "Retries %u, resets %u, DMA jobs %lu, %.3f sec waiting for the device.\n"
+      "Write cache absorbed %u writes and served %u reads, and wrote %u runs.\n"
+      "FAT and directory cache hits %u, misses %u.\n",
+      sdcard_stats.sectors_read, sdcard_stats.sectors_written, sdcard_stats.sectors_erased, sdcard_stats.flash_reads,
+      known_writes_elided, known_reads_saved, sdcard_stats.verify_failures, sdcard_stats.retries, sdcard_stats.resets,
+      dma_jobs, sdcard_stats.busy_us / 1e6, wcache_writes_absorbed, wcache_reads_served, wcache_runs,
+      fat32_cache_hits, fat32_cache_misses);
+#endif
+}
+
+void show_card_speed(unsigned char bus)
+{
+  // The host has no meaningful read speed to report
+  if (!card_probe[bus].speed)
+    return;
+  write_line("SD Card read speed =       KB/sec", 2);
+  screen_decimal(screen_line_address - 80 + 23, card_probe[bus].speed);
+}
+
+void show_mbr(unsigned char bus)
+{
+  char i;
+
+  lcopy((long)card_probe[bus].partition_table, (long)&sector_buffer[0x1be], 66);
 
   write_line("", 0);
 
@@ -518,6 +686,34 @@ unsigned char file_count;
 unsigned long file_offset, next_offset, file_len, first_sector;
 char eightthree[8 + 3 + 1];
 
+unsigned char confirm_benchmark(unsigned char bus)
+{
+  // The benchmark overwrites sectors 1 - $7FF, so only run it when no
+  // partition starts in there, and after the same confirmation as formatting
+  if (!sdcard_benchmark_allowed(card_probe[bus].partition_table)) {
+    write_line_colour("A partition starts below sector $800, so the benchmark would destroy it.", 1, 2);
+    return 0;
+  }
+#ifdef __CC65__
+  write_line("", 0);
+  strcpy(buffer, "Type DELETE EVERYTHING to overwrite sectors 1 - $7FF of the ");
+  strcat(buffer, bus ? "external" : "internal");
+  strcat(buffer, " SD:");
+  write_line_colour(buffer, 1, 2);
+  screen_line_address++;
+  if (read_line(buffer, 79))
+    write_line_colour(buffer, 1, 7);
+  screen_line_address--;
+  return !strcmp(buffer, "DELETE EVERYTHING");
+#else
+  printf("Type DELETE EVERYTHING to overwrite sectors 1 - 2047 of %s.\n", sdcard_path);
+  if (!fgets(buffer, sizeof(buffer), stdin))
+    return 0;
+  buffer[strcspn(buffer, "\r\n")] = 0;
+  return !strcmp(buffer, "DELETE EVERYTHING");
+#endif
+}
+
 void scan_slots(void)
 {
   unsigned char i, j;
@@ -551,6 +747,42 @@ void scan_slots(void)
   }
 }
 
+// Totals for the file payloads copied by populate_file_system()
+uint32_t populate_bytes, populate_us;
+uint16_t populate_rewrites;
+
+unsigned long populate_flash_addr;
+
+unsigned char populate_stage(const long buffer, const unsigned long sectors)
+{
+  // Read the next run of up to POPULATE_SECTORS sectors from flash
+  unsigned char j, run = sectors < POPULATE_SECTORS ? sectors : POPULATE_SECTORS;
+
+  for (j = 0; j < run; j++) {
+    flash_readsector(populate_flash_addr);
+    lcopy((long)sector_buffer, buffer + ((long)j << 9), 512);
+    populate_flash_addr += 512;
+  }
+  return run;
+}
+
+void report_populate_speed(void)
+{
+  // KB/sec is the same as bytes/msec
+  uint32_t msec = populate_us / 1000;
+  uint32_t kb_per_sec = msec ? populate_bytes / msec : 0;
+
+  write_line("   Copied       KB at      .   MB/sec", 1);
+  screen_decimal(screen_line_address - 80 + 10, populate_bytes >> 10);
+  screen_decimal(screen_line_address - 80 + 22, kb_per_sec / 1000);
+  lpoke(screen_line_address - 80 + 28, '0' + (kb_per_sec % 1000) / 100);
+  lpoke(screen_line_address - 80 + 29, '0' + (kb_per_sec % 100) / 10);
+  if (populate_rewrites) {
+    write_line("   Rewrote       sectors that failed to verify", 1);
+    screen_decimal(screen_line_address - 80 + 11, populate_rewrites);
+  }
+}
+
 char populate_file_system(unsigned char slot)
 {
   unsigned char i, j, k;
@@ -565,6 +797,9 @@ char populate_file_system(unsigned char slot)
   write_line(buffer, 1);
   file_offset = mega65slot[slot].file_offset;
   file_count = mega65slot[slot].file_count;
+  populate_bytes = 0;
+  populate_us = 0;
+  populate_rewrites = 0;
   write_line("   Files in Core, starting at $        .", 1);
   format_decimal(screen_line_address - 79, file_count, 2);
   screen_hex(screen_line_address - 48, file_offset);
@@ -603,37 +838,307 @@ char populate_file_system(unsigned char slot)
         fat_partition_start + fat1_sector, fat_partition_start + fat2_sector);
 
     if (first_sector) {
-      // Write out file sectors
-      unsigned long addr;
-      for (addr = 0; addr <= file_len; addr += 512) {
-        POKE(0xD020, PEEK(0xD020) + 1);
-        flash_readsector(file_offset + addr);
-        sdcard_writesector(first_sector++);
+      // Stream the file across in runs of up to POPULATE_SECTORS sectors:
+      // stage each run from flash, write it with one multi-sector write,
+      // then read it back to verify it. Flash reads go through the same SD
+      // controller, so there is nothing to overlap with the write.
+      unsigned long sectors = (file_len + 511) >> 9;
+      unsigned char run;
+      uint32_t start = timer_read_us();
+
+      populate_flash_addr = file_offset;
+      progress_begin("Copying", sectors);
+      while ((run = populate_stage(POPULATE_BUFFER, sectors))) {
+        sectors -= run;
+        sdcard_writesectors(first_sector, POPULATE_BUFFER, run);
+        populate_rewrites += sdcard_verifysectors(first_sector, POPULATE_BUFFER, run);
+        first_sector += run;
+        progress_update(((file_len + 511) >> 9) - sectors);
       }
+      progress_end();
+      populate_us += timer_read_us() - start;
+      populate_bytes += file_len;
 #ifdef __CC65__
       recolour_last_line(1);
 #endif
     }
     else {
-      write_line("!! Error writing file", 1);
-#ifdef __CC65__
-      recolour_last_line(2);
-#endif
+      write_line_colour("!! Error writing file", 1, 2);
     }
 
     file_offset = next_offset;
   }
 
+  report_populate_speed();
+
   return 0;
 }
 
+#ifndef __CC65__
+/*
+  Files to copy to the card: the command line arguments, and the lines of
+  --manifest files. They are all checked, including that no two of them end
+  up with the same name, before we start formatting. They are sorted by
+  directory, so that each directory is indexed only once, and created as
+  one batch, back to back in one extent and with their FAT chains written
+  together, before any of their contents are copied.
+*/
+struct copy_file {
+  char *source;
+  char dosname[256];
+  uint64_t size;
+  uint32_t first_sector;
+  unsigned int order;
+};
+struct copy_file *copy_files = NULL;
+unsigned int copy_file_count = 0, copy_file_slots = 0;
+
+void add_copy_file(const char *source, const char *destination)
+{
+  // <destination> is a relative path, e.g., games/arcade.d81, and the
+  // directories in it are created on the card as well
+  struct copy_file *c;
+  struct stat st;
+  char name[1024], extension[1024];
+  const char *base = strrchr(destination, '/');
+  const char *d;
+  int i;
+
+  base = base ? base + 1 : destination;
+  if (base - destination > 200) {
+    fprintf(stderr, "'%s' is too deep a path\n", destination);
+    exit(-1);
+  }
+  for (d = destination; d < base; d = strchr(d, '/') + 1) {
+    if (*d == '/' || strchr(d, '/') - d > 8 || memchr(d, '.', strchr(d, '/') - d)) {
+      fprintf(stderr, "directory names in '%s' must be relative, and fit in 8 characters\n", destination);
+      exit(-1);
+    }
+  }
+  bzero(name, sizeof(name));
+  bzero(extension, sizeof(extension));
+  if (sscanf(base, "%1023[^.].%1023s", name, extension) != 2) {
+    fprintf(stderr, "Could notparse name and extension from file name '%s'\n", base);
+    exit(-1);
+  }
+  if (name[8] || extension[3]) {
+    fprintf(stderr, "filename or extension too long. Must fit in 8.3 DOS filename. Got '%s'.'%s'\n", name, extension);
+    exit(-1);
+  }
+  if (stat(source, &st) || !S_ISREG(st.st_mode) || st.st_size > 0xffffffffLL) {
+    fprintf(stderr, "Could not open %s for reading, or it is too big\n", source);
+    exit(-1);
+  }
+
+  if (copy_file_count == copy_file_slots) {
+    copy_file_slots = copy_file_slots ? copy_file_slots * 2 : 64;
+    copy_files = realloc(copy_files, copy_file_slots * sizeof(struct copy_file));
+    if (!copy_files) {
+      perror("realloc");
+      exit(-1);
+    }
+  }
+  c = &copy_files[copy_file_count];
+  c->source = strdup(source);
+  snprintf(c->dosname, sizeof(c->dosname), "%.*s%-8.8s%-3.3s", (int)(base - destination), destination, name, extension);
+  // make dos name upper case
+  for (i = 0; c->dosname[i]; i++)
+    if (c->dosname[i] >= 'a' && c->dosname[i] <= 'z')
+      c->dosname[i] -= 0x20;
+  c->size = st.st_size;
+  c->first_sector = 0;
+  c->order = copy_file_count++;
+}
+
+void read_manifest(const char *path)
+{
+  // One file per line, as <source> [<destination>]
+  FILE *f = fopen(path, "r");
+  char line[4096], source[2048], destination[2048];
+  int n;
+
+  if (!f) {
+    perror(path);
+    exit(-1);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    n = sscanf(line, "%2047s %2047s", source, destination);
+    if (n < 1 || source[0] == '#')
+      continue;
+    add_copy_file(source, n == 2 ? destination : source);
+  }
+  fclose(f);
+}
+
+int copy_file_compare(const void *a, const void *b)
+{
+  // By directory, and in the order given within a directory
+  const struct copy_file *x = a, *y = b;
+  const char *xd = strrchr(x->dosname, '/'), *yd = strrchr(y->dosname, '/');
+  int xl = xd ? xd - x->dosname : 0, yl = yd ? yd - y->dosname : 0;
+  int r = memcmp(x->dosname, y->dosname, xl < yl ? xl : yl);
+
+  if (!r)
+    r = xl - yl;
+  if (!r)
+    r = x->order - y->order;
+  return r;
+}
+
+int copy_file_name_compare(const void *a, const void *b)
+{
+  return strcmp((*(struct copy_file *const *)a)->dosname, (*(struct copy_file *const *)b)->dosname);
+}
+
+void check_copy_files(void)
+{
+  // Two files with the same name on the card would only be noticed once the
+  // card has been formatted, so look for them by sorting by name first
+  struct copy_file **by_name;
+  unsigned int i;
+
+  if (!copy_file_count)
+    return;
+  qsort(copy_files, copy_file_count, sizeof(struct copy_file), copy_file_compare);
+
+  by_name = malloc(copy_file_count * sizeof(struct copy_file *));
+  if (!by_name) {
+    perror("malloc");
+    exit(-1);
+  }
+  for (i = 0; i < copy_file_count; i++)
+    by_name[i] = &copy_files[i];
+  qsort(by_name, copy_file_count, sizeof(struct copy_file *), copy_file_name_compare);
+  for (i = 1; i < copy_file_count; i++) {
+    if (!strcmp(by_name[i - 1]->dosname, by_name[i]->dosname)) {
+      fprintf(stderr, "%s and %s would both be copied to %s\n", by_name[i - 1]->source, by_name[i]->source,
+          by_name[i]->dosname);
+      exit(-1);
+    }
+  }
+  free(by_name);
+}
+
+void populate_from_host(const uint32_t data_start, const uint32_t fat1, const uint32_t fat2)
+{
+  uint64_t clusters = 0, bytes = 0, offset;
+  uint32_t cluster_bytes = 512 * sectors_per_cluster;
+  uint32_t start = timer_read_us();
+  unsigned int i, created = 0;
+  struct copy_file *c;
+  uint8_t *buffer;
+  size_t got;
+  FILE *f;
+
+  if (!copy_file_count)
+    return;
+
+  for (i = 0; i < copy_file_count; i++) {
+    clusters += (copy_files[i].size + cluster_bytes - 1) / cluster_bytes;
+    bytes += copy_files[i].size;
+  }
+  printf("Creating %u files, %llu KiB in %llu clusters.\n", copy_file_count, (unsigned long long)bytes >> 10,
+      (unsigned long long)clusters);
+  if (clusters >= fs_clusters || !fat32_batch_begin(clusters, data_start, fat1, fat2)) {
+    fprintf(stderr, "There is not enough contiguous free space for the files.\n");
+    exit(-1);
+  }
+  for (i = 0; i < copy_file_count; i++) {
+    c = &copy_files[i];
+    c->first_sector = fat32_batch_add_file(c->dosname, c->size);
+    if (c->first_sector)
+      created++;
+    else
+      fprintf(stderr, "Could not create %s for %s: it exists already, or a file is in the way\n", c->dosname,
+          c->source);
+  }
+  fat32_batch_end();
+
+  // Copy the contents, which are now in the same order on the card
+  buffer = malloc(COPY_BUFFER_BYTES);
+  if (!buffer) {
+    perror("malloc");
+    exit(-1);
+  }
+  for (i = 0; i < copy_file_count; i++) {
+    c = &copy_files[i];
+    if (!c->first_sector || !c->size)
+      continue;
+    fprintf(stdout, "Writing file %s to SD card image\n", c->source);
+    f = fopen(c->source, "r");
+    if (!f) {
+      fprintf(stderr, "Could not open file for reading\n");
+      exit(-1);
+    }
+    progress_begin("Copying", (c->size + 511) / 512);
+    for (offset = 0; offset < c->size; offset += got) {
+      // The file may have grown since it was checked, but only size bytes
+      // were allocated for it
+      got = fread(buffer, 1, c->size - offset < COPY_BUFFER_BYTES ? c->size - offset : COPY_BUFFER_BYTES, f);
+      if (!got)
+        break;
+      bzero(&buffer[got], (512 - (got & 511)) & 511);
+      sdcard_writesectors(c->first_sector + offset / 512, (long)buffer, (got + 511) / 512);
+      progress_update((offset + got + 511) / 512);
+    }
+    progress_end();
+    fclose(f);
+  }
+  free(buffer);
+
+  printf("Wrote %u files, %llu KiB, in %.3f sec.\n", created, (unsigned long long)bytes >> 10,
+      (timer_read_us() - start) / 1e6);
+}
+#endif
+
 #ifdef __CC65__
 void main(void)
 #else
 int main(int argc, char **argv)
 #endif
 {
-  unsigned char key, cardSlot, slotAvail;
+  unsigned char key, cardSlot = 0, slotAvail;
+
+#ifndef __CC65__
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "d:i:s:bt:m:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'm':
+      read_manifest(optarg);
+      break;
+    case 't':
+      trace_open(optarg);
+      break;
+    case 'b':
+      benchmark = 1;
+      break;
+    case 'd':
+      sdcard_path = optarg;
+      break;
+    case 'i':
+      if (!strcmp(optarg, "buffered"))
+        sdcard_open_flags = 0;
+      else if (!strcmp(optarg, "sync"))
+        sdcard_open_flags = O_SYNC;
+      else if (!strcmp(optarg, "direct"))
+        sdcard_open_flags = O_DIRECT;
+      else
+        usage();
+      break;
+    case 's':
+      sdcard_size_override = parse_size(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  // Check all the files before touching the card
+  for (opt = optind; opt < argc; opt++)
+    add_copy_file(argv[opt], argv[opt]);
+  check_copy_files();
+#endif
 
 rescanSlots:
 #ifdef __CC65__
@@ -653,51 +1158,41 @@ next_card:
   write_line("Detecting SD card(s) (can take a while)", 1);
   write_line("", 0);
 
-  write_line("SD Card 0 (Internal SD slot):", 1);
-#ifdef __CC65__
-  recolour_last_line(0x2c);
-#endif
+  write_line_colour("SD Card 0 (Internal SD slot):", 1, 0x2c);
 
   sdcard_select(0);
   if (sdcard_reset()) {
-    write_line("No card detected on bus 0", 2);
-#ifdef __CC65__
-    recolour_last_line(8);
-#endif
+    card_probe[0].valid = 0;
+    write_line_colour("No card detected on bus 0", 2, 8);
   }
   else {
-    sdcard_sectors = sdcard_getsize();
+    probe_card(0);
 
     // Report speed of SD card
-    sdcard_readspeed_test();
+    show_card_speed(0);
 
     // Show summary of current MBR
-    show_mbr();
+    show_mbr(0);
 
     slotAvail |= 1;
   }
 
   write_line("", 0);
-  write_line("SD Card 1 (External microSD slot):", 1);
-#ifdef __CC65__
-  recolour_last_line(0x2c);
-#endif
+  write_line_colour("SD Card 1 (External microSD slot):", 1, 0x2c);
 
   sdcard_select(1);
   if (sdcard_reset()) {
-    write_line("No card detected on bus 1", 2);
-#ifdef __CC65__
-    recolour_last_line(8);
-#endif
+    card_probe[1].valid = 0;
+    write_line_colour("No card detected on bus 1", 2, 8);
   }
   else {
-    sdcard_sectors = sdcard_getsize();
+    probe_card(1);
 
     // Report speed of SD card
-    sdcard_readspeed_test();
+    show_card_speed(1);
 
     // Show summary of current MBR
-    show_mbr();
+    show_mbr(1);
 
     slotAvail |= 2;
   }
@@ -705,31 +1200,58 @@ next_card:
 
   // Make user select SD card
   POKE(0xd020, 6);
-  strcpy(buffer, "Please select SD card to modify or r to rescan (");
+  strcpy(buffer, "Select SD card to modify, b to benchmark or r to rescan (");
   if (slotAvail&1)
     strcat(buffer, "0/");
   if (slotAvail&2)
     strcat(buffer, "1/");
-  strcat(buffer, "r): ");
-  write_line(buffer, 1);
+  strcat(buffer, "b/r): ");
+  write_line_colour(buffer, 1, 7);
 #ifdef __CC65__
-  recolour_last_line(7);
 
   do {
     key = mega65_getkey();
-  } while (key != 'r' && (!(slotAvail&1) || key != '0') && (!(slotAvail&2) || key != '1'));
-  if (key == 'r')
+  } while (key != 'r' && key != 'b' && (!(slotAvail&1) || key != '0') && (!(slotAvail&2) || key != '1'));
+  if (key == 'r') {
+    forget_cards();
+    goto rescanSlots;
+  }
+  if (key == 'b') {
+    write_line_colour("Benchmark which SD card?", 1, 7);
+    do {
+      key = mega65_getkey();
+    } while ((!(slotAvail&1) || key != '0') && (!(slotAvail&2) || key != '1'));
+    sdcard_select(key & 1);
+    sdcard_open();
+    if (confirm_benchmark(key & 1))
+      sdcard_benchmark(card_probe[key & 1].sectors);
+    else
+      write_line_colour("Benchmark cancelled.", 1, 2);
+    write_line("Press any key to continue", 1);
+    mega65_getkey();
     goto rescanSlots;
+  }
 
   cardSlot = key & 1;
   sdcard_select(cardSlot);
 #endif
 
-  // Then make sure we have correct information for the selected card
+  // Then make sure we have correct information for the selected card.
+  // Normally we still have it from detecting the cards.
   sdcard_open();
-  sdcard_sectors = sdcard_getsize();
-  sdcard_readspeed_test();
-  show_mbr();
+  probe_card(cardSlot);
+  sdcard_sectors = card_probe[cardSlot].sectors;
+
+#ifndef __CC65__
+  if (benchmark) {
+    if (!confirm_benchmark(cardSlot)) {
+      fprintf(stderr, "Benchmark cancelled.\n");
+      exit(-1);
+    }
+    sdcard_benchmark(sdcard_sectors);
+    return 0;
+  }
+#endif
 
   // Calculate sectors for the system and FAT32 partitions.
   // This is the size of the card, minus 2,048 (=0x0800) sectors.
@@ -790,7 +1312,7 @@ next_card:
   fs_data_sectors = fs_clusters * sectors_per_cluster;
 
 #ifndef __CC65__
-  printf("Type DELETE EVERYTHING to delete everything on %s SD.\n", cardSlot&1 ? "external" : "internal");
+  printf("Type DELETE EVERYTHING to delete everything on %s.\n", sdcard_path);
   char line[1024];
   fgets(line, 1024, stdin);
   while (line[0] && line[strlen(line) - 1] == '\n')
@@ -809,40 +1331,19 @@ next_card:
   strcpy(buffer, "Format ");
   strcat(buffer, cardSlot&1 ? "external" : "internal");
   strcat(buffer, " Card with new partition table and FAT32 file system?");
-  write_line(buffer, 1);
-  recolour_last_line(7);
+  write_line_colour(buffer, 1, 7);
   {
-    char col = 6;
-    int megs = (fat_partition_sectors + 1) / 2048;
-    screen_decimal(screen_line_address + 2, megs);
-    if (megs < 10000)
-      col = 5;
-    if (megs < 1000)
-      col = 4;
-    if (megs < 100)
-      col = 3;
-    if (megs < 10)
-      col = 2;
+    char col = 1 + screen_decimal(screen_line_address + 2, (fat_partition_sectors + 1) / 2048);
     write_line("MiB VFAT32 Data Partition @ $$$$$$$$:", 2 + col);
     screen_hex(screen_line_address - 80 + 28 + 2 + col, fat_partition_start);
   }
-  write_line("  $         Clusters,       Sectors/FAT,       Reserved Sectors.", 0);
-  screen_hex(screen_line_address - 80 + 3, fs_clusters);
+  write_line("            Clusters,       Sectors/FAT,       Reserved Sectors.", 0);
+  screen_decimal(screen_line_address - 80 + 2, fs_clusters);
   screen_decimal(screen_line_address - 80 + 22, fat_sectors);
   screen_decimal(screen_line_address - 80 + 41, reserved_sectors);
 
   {
-    char col = 6;
-    int megs = (sys_partition_sectors + 1) / 2048;
-    screen_decimal(2 + screen_line_address, megs);
-    if (megs < 10000)
-      col = 5;
-    if (megs < 1000)
-      col = 4;
-    if (megs < 100)
-      col = 3;
-    if (megs < 10)
-      col = 2;
+    char col = 1 + screen_decimal(2 + screen_line_address, (sys_partition_sectors + 1) / 2048);
     write_line("MiB MEGA65 System Partition @ $$$$$$$$:", 2 + col);
     screen_hex(screen_line_address - 80 + 30 + 2 + col, sys_partition_start);
   }
@@ -856,23 +1357,21 @@ next_card:
       strcpy(buffer, "Type DELETE EVERYTHING to continue formatting the ");
       strcat(buffer, cardSlot&1 ? "external" : "internal");
       strcat(buffer, " SD");
-      write_line(buffer, 1);
-      recolour_last_line(2);
-      write_line("or type FIX MBR to re-write MBR:", 1);
-      recolour_last_line(2);
+      write_line_colour(buffer, 1, 2);
+      write_line_colour("or type FIX MBR to re-write MBR:", 1, 2);
       screen_line_address++;
       len = read_line(buffer, 79);
       screen_line_address--;
       if (len) {
-        write_line(buffer, 1);
-        recolour_last_line(7);
+        write_line_colour(buffer, 1, 7);
       }
     }
 
     if (!strcmp("FIX MBR", buffer)) {
       build_mbr(sys_partition_start, sys_partition_sectors, fat_partition_start, fat_partition_sectors);
       sdcard_writesector(0);
-      show_mbr();
+      snapshot_mbr(cardSlot);
+      show_mbr(cardSlot);
       write_line("MBR Re-written", 0);
       while (1)
         continue;
@@ -883,8 +1382,7 @@ next_card:
       break;
     }
     else if (strcmp("DELETE EVERYTHING", buffer) && strcmp("BATCH MODE", buffer)) {
-      write_line("Entered text does not match. Try again.", 1);
-      recolour_last_line(8);
+      write_line_colour("Entered text does not match. Try again.", 1, 8);
     }
     else
       // String matches -- so proceed
@@ -892,6 +1390,9 @@ next_card:
   }
 #endif
 
+  // Count only what formatting does
+  reset_stats();
+
   // MBR is always the first sector of a disk
 #ifdef __CC65__
   write_line("", 0);
@@ -899,7 +1400,8 @@ next_card:
 #endif
   build_mbr(sys_partition_start, sys_partition_sectors, fat_partition_start, fat_partition_sectors);
   sdcard_writesector(0);
-  show_mbr();
+  snapshot_mbr(cardSlot);
+  show_mbr(cardSlot);
 
   while (0) {
     build_mbr(sys_partition_start, sys_partition_sectors, fat_partition_start, fat_partition_sectors);
@@ -907,6 +1409,10 @@ next_card:
     //  show_mbr();
   }
 
+  // Gather the scattered single sector writes of the file system structures,
+  // and write them out in order once they are all built.
+  wcache_begin();
+
 #ifdef __CC65__
   // write_line("Erasing reserved sectors before first partition...",0);
 #endif
@@ -988,11 +1494,18 @@ next_card:
   // Make sure all other sectors are empty
 #if 1
   sdcard_erase(fat_partition_start + 1 + 1, fat_partition_start + 6 - 1);
-  sdcard_erase(fat_partition_start + 6 + 1, fat_partition_start + fat1_sector - 1);
+  sdcard_erase(fat_partition_start + 7 + 1, fat_partition_start + fat1_sector - 1);
   sdcard_erase(fat_partition_start + fat1_sector + 1, fat_partition_start + fat2_sector - 1);
   sdcard_erase(fat_partition_start + fat2_sector + 1, fat_partition_start + rootdir_sector - 1);
   sdcard_erase(fat_partition_start + rootdir_sector + 1, fat_partition_start + rootdir_sector + 1 + sectors_per_cluster - 1);
 #endif
+  wcache_commit();
+
+  // The FAT is new, so forget anything we know about free space on this card
+  fat32_reset_allocator();
+
+  // Creating files rewrites the same directory, FAT and FSInfo sectors
+  wcache_begin();
 
 #ifdef __CC65__
   /* Check if flash slot 0 contains embedded files that we should write to the SD card.
@@ -1008,7 +1521,7 @@ next_card:
       if (!mega65slot[i].version[0] || !mega65slot[i].file_count) continue;
       strcpy(buffer, "(#) MEGA65 -    Files");
       buffer[1] = 0x30 + i;
-      format_decimal((int)buffer + 13, mega65slot[i].file_count, 2);
+      format_decimal((unsigned int)buffer + 13, mega65slot[i].file_count, 2);
       write_line(buffer, 3);
       write_line(mega65slot[i].version, 7);
       if (mega65slot[i].file_count) {
@@ -1017,12 +1530,10 @@ next_card:
       }
     }
     if (!slotCount) {
-      write_line("No slots with files found, skipping population.",1);
-      recolour_last_line(7);
+      write_line_colour("No slots with files found, skipping population.", 1, 7);
     }
     else {
-      write_line("Populate SD card with embedded files from slot # or s to skip (#/s)?", 1);
-      recolour_last_line(7);
+      write_line_colour("Populate SD card with embedded files from slot # or s to skip (#/s)?", 1, 7);
       do {
         key = mega65_getkey();
         if (key == 's')
@@ -1039,60 +1550,23 @@ next_card:
   }
 #else
 
-  // Process loading and reading of files from disk image
-  printf("Processing %d arguments.\n", argc);
-  for (int i = 1; i < argc; i++) {
-    struct stat st;
-    fprintf(stdout, "Writing file %s to SD card image\n", argv[i]);
-    stat(argv[i], &st);
-
-    FILE *f = fopen(argv[i], "r");
-    if (!f) {
-      fprintf(stderr, "Could not open file for reading\n");
-      exit(-1);
-    }
+  // Copy the files from the host
+  populate_from_host(fat_partition_start + rootdir_sector, fat_partition_start + fat1_sector,
+      fat_partition_start + fat2_sector);
 
-    char dosname[4096];
-    char name[1024], extension[1024];
-    bzero(name, sizeof(name));
-    bzero(extension, sizeof(extension));
-    if (sscanf(argv[i], "%[^.].%s", name, extension) != 2) {
-      fprintf(stderr, "Could notparse name and extension from file name\n");
-      exit(-1);
-    }
-    if (name[8] || extension[3]) {
-      fprintf(stderr, "filename or extension too long. Must fit in 8.3 DOS filename. Got '%s'.'%s'\n", name, extension);
-      exit(-1);
-    }
-    snprintf(dosname, 4096, "%-8s%-3s", name, extension);
-
-    // make dos name upper case
-    for (int i = 0; i < 12; i++)
-      if (dosname[i] >= 'a' && dosname[i] <= 'z')
-        dosname[i] -= 0x20;
-
-    unsigned int first_sector = fat32_create_contiguous_file(dosname, st.st_size, fat_partition_start + rootdir_sector,
-        fat_partition_start + fat1_sector, fat_partition_start + fat2_sector);
-    if (first_sector) {
-      // Write out sectors
-      unsigned long addr;
-      for (addr = 0; addr <= st.st_size; addr += 512) {
-        fread(sector_buffer, 1, 512, f);
-        sdcard_writesector(first_sector + (addr / 512));
-      }
-    }
-    fclose(f);
-    printf("File written.\n");
-  }
 #endif
 
+  wcache_commit();
+  show_stats();
+
 #ifdef __CC65__
+  trace_save(fat_partition_start + rootdir_sector, fat_partition_start + fat1_sector,
+      fat_partition_start + fat2_sector);
 
   POKE(0xd020U, 6);
   POKE(0xd021U, 6);
   write_line("", 0);
-  write_line("SD Card has been formatted.", 1);
-  recolour_last_line(0x37);
+  write_line_colour("SD Card has been formatted.", 1, 0x37);
   if (!have_sdfiles)
     write_line("Remove, Copy SD Essentials and MEGA65.ROM, reinsert AND reboot.", 1);
   else if (!have_rom)
@@ -1112,6 +1586,7 @@ next_card:
       continue;
     POKE(0xD610, 0);
 
+    forget_cards();
     goto next_card;
   }
 
@@ -0,0 +1,314 @@
+/*
+  Host-side benchmarks for the UNIX SD card HAL and the FAT32 code.
+
+  By default, compares the old stdio based sector path (fseek +
+  fread/fwrite per sector) against the positional pread/pwrite engine in
+  fdisk_hal_unix.c, both one sector at a time and in multi-sector runs.
+
+  With -f <count>, lays out an empty FAT32 file system on the image
+  instead, and times creating <count> D81 sized contiguous files with
+  fat32_create_contiguous_file().
+
+  With -c, checks instead that looking up names in a directory that is
+  full up to the end of its last cluster (an existing directory, or a
+  duplicate file) does not cut off part of it when the next entry chains
+  on a new cluster, and that a file that gets no directory entry, as the
+  directory cannot grow, gives its clusters back. Exits with 1 if not.
+
+  usage: m65fdisk-bench [-c] [-f count] [image [megabytes]]
+
+  The image defaults to /dev/shm/m65fdisk-bench.img, so that the
+  numbers measure the I/O path rather than the backing store.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_fat32.h"
+#include "fdisk_wcache.h"
+
+#define RUN_SECTORS 128
+#define D81_SIZE 819200
+
+extern int sdcard_fd;
+
+uint8_t sector_buffer[512];
+uint8_t run_buffer[RUN_SECTORS * 512];
+
+// File system geometry, as fdisk.c would set it
+uint32_t reserved_sectors = 568;
+uint8_t sectors_per_cluster = 8;
+uint32_t fs_clusters, fat_sectors, fat1_sector, fat2_sector, root_dir_sector;
+
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, uint32_t sectors, double seconds)
+{
+  printf("  %-32s %8.1f MB/sec  %8.2f usec/sector\n", name, sectors * 512.0 / 1048576.0 / seconds,
+      seconds * 1e6 / sectors);
+}
+
+void bare_fat32(uint32_t sectors)
+{
+  // Bare FAT32 layout at the start of the image, without the FAT32 boot
+  // sector or MBR, which the allocator does not look at.
+  fs_clusters = (sectors - reserved_sectors) / sectors_per_cluster;
+  fat_sectors = (fs_clusters + 127) / 128;
+  fs_clusters -= (2 * fat_sectors + sectors_per_cluster - 1) / sectors_per_cluster;
+  fat1_sector = reserved_sectors;
+  fat2_sector = fat1_sector + fat_sectors;
+  root_dir_sector = fat2_sector + fat_sectors;
+
+  sdcard_erase(fat1_sector, root_dir_sector + sectors_per_cluster - 1);
+  memset(sector_buffer, 0, 512);
+  *(uint32_t *)&sector_buffer[0] = 0x0ffffff8;
+  *(uint32_t *)&sector_buffer[4] = 0x0fffffff;
+  *(uint32_t *)&sector_buffer[8] = 0x0ffffff8;
+  sdcard_writesector(fat1_sector);
+  sdcard_writesector(fat2_sector);
+  fat32_reset_allocator();
+}
+
+void bench_files(uint32_t sectors, uint32_t count)
+{
+  uint32_t n;
+  char name[12];
+  double t, batch;
+
+  bare_fat32(sectors);
+  printf("Creating %u files of %u bytes on %u clusters:\n", count, D81_SIZE, fs_clusters);
+  t = batch = now();
+  wcache_begin();
+  for (n = 0; n < count; n++) {
+    snprintf(name, sizeof(name), "D%07uD81", n % 10000000);
+    if (!fat32_create_contiguous_file(name, D81_SIZE, root_dir_sector, fat1_sector, fat2_sector)) {
+      printf("  Could not create file #%u (disk full?)\n", n);
+      break;
+    }
+    if ((n + 1) % 100 == 0) {
+      printf("  files %5u..%5u: %8.2f msec/file\n", n - 99, n, (now() - batch) * 1e3 / 100);
+      batch = now();
+    }
+  }
+  wcache_commit();
+  t = now() - t;
+  printf("  %u files in %.3f sec: %.1f files/sec\n", n, t, n / t);
+}
+
+uint32_t count_entries(uint32_t cluster, uint32_t *clusters)
+{
+  // Count the names in the directory starting at <cluster>, and the
+  // clusters of its chain, reading the image directly
+  uint32_t entries = 0;
+  uint16_t offset;
+  uint8_t sn;
+
+  *clusters = 0;
+  while (cluster >= 2 && cluster < 0x0ffffff8) {
+    (*clusters)++;
+    for (sn = 0; sn < sectors_per_cluster; sn++) {
+      sdcard_readsector(root_dir_sector + (cluster - 2) * sectors_per_cluster + sn);
+      for (offset = 0; offset < 512; offset += 32) {
+        if (!sector_buffer[offset])
+          return entries;
+        if (sector_buffer[offset] != 0xe5)
+          entries++;
+      }
+    }
+    sdcard_readsector(fat1_sector + cluster / 128);
+    cluster = *(uint32_t *)&sector_buffer[(cluster & 127) << 2] & 0x0fffffff;
+  }
+  return entries;
+}
+
+int check_directories(uint32_t sectors)
+{
+  // Entries per cluster of the root directory
+  uint32_t per_cluster = sectors_per_cluster * 16;
+  uint32_t n, entries, clusters;
+  unsigned char pass, failed = 0;
+  long size;
+  char name[12];
+
+  for (pass = 0; pass < 2; pass++) {
+    // A directory, and files to fill the root directory to the end of its
+    // second cluster
+    bare_fat32(sectors);
+    fat32_create_directory("A", root_dir_sector, fat1_sector, fat2_sector);
+    for (n = 0; n < 2 * per_cluster - 1; n++) {
+      snprintf(name, sizeof(name), "F%07uBIN", n % 10000000);
+      fat32_create_contiguous_file(name, 1, root_dir_sector, fat1_sector, fat2_sector);
+    }
+
+    // Find an entry in the first cluster, then add one that needs a third
+    if (!pass)
+      fat32_create_directory("A", root_dir_sector, fat1_sector, fat2_sector);
+    else if (fat32_create_contiguous_file("F0000000BIN", 1, root_dir_sector, fat1_sector, fat2_sector))
+      failed = 1;
+    fat32_create_contiguous_file("NEW.BIN", 1, root_dir_sector, fat1_sector, fat2_sector);
+
+    entries = count_entries(2, &clusters);
+    printf("After %s: %u entries in %u clusters of the root directory\n",
+        pass ? "a duplicate file" : "an existing directory", entries, clusters);
+    if (entries != 2 * per_cluster + 1 || clusters != 3)
+      failed = 1;
+  }
+
+  // Three files, then directories to use up the clusters before the first
+  // one and fill the root directory, then a file that takes all the rest, so
+  // that there is no cluster left to extend the root directory with
+  bare_fat32(sectors);
+  for (n = 0; n < 3; n++) {
+    snprintf(name, sizeof(name), "F%07uBIN", n);
+    fat32_create_contiguous_file(name, 1, root_dir_sector, fat1_sector, fat2_sector);
+  }
+  for (n = 3; n < per_cluster; n++) {
+    snprintf(name, sizeof(name), "D%07u", n);
+    fat32_create_directory(name, root_dir_sector, fat1_sector, fat2_sector);
+  }
+  // The files own clusters up to 4 * 128
+  size = (long)(fs_clusters - 4 * 128) * 512 * sectors_per_cluster;
+  if (fat32_create_contiguous_file("ALL.BIN", size, root_dir_sector, fat1_sector, fat2_sector))
+    failed = 1;
+  // Only fits if ALL.BIN gave its clusters back
+  if (!fat32_create_contiguous_file("NEW.BIN", 1, root_dir_sector, fat1_sector, fat2_sector))
+    failed = 1;
+  entries = count_entries(2, &clusters);
+  printf("After a full disk: %u entries in %u clusters of the root directory\n", entries, clusters);
+  if (entries != per_cluster + 1 || clusters != 2)
+    failed = 1;
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  char *image = "/dev/shm/m65fdisk-bench.img";
+  uint32_t sectors = 64 * 2048;
+  uint32_t files = 0;
+  unsigned char check = 0;
+  uint32_t n;
+  double t;
+  char name[40];
+  FILE *f;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "cf:")) != -1) {
+    switch (opt) {
+    case 'c':
+      check = 1;
+      // Room for the files, which each own a whole FAT sector of clusters
+      sectors = 300 * 128 * 8;
+      break;
+    case 'f':
+      files = atoi(optarg);
+      // Big enough to hold them all
+      sectors = (files / 256 + 1) * 512 * 2048;
+      break;
+    default:
+      fprintf(stderr, "usage: m65fdisk-bench [-c] [-f count] [image [megabytes]]\n");
+      exit(-1);
+    }
+  }
+
+  if (argc > optind)
+    image = argv[optind];
+  if (argc > optind + 1)
+    sectors = atoi(argv[optind + 1]) * 2048;
+  if (!sectors) {
+    fprintf(stderr, "usage: m65fdisk-bench [-c] [-f count] [image [megabytes]]\n");
+    exit(-1);
+  }
+
+  f = fopen(image, "w+");
+  if (!f) {
+    perror("fopen");
+    exit(-1);
+  }
+  if (ftruncate(fileno(f), (off_t)sectors * 512)) {
+    perror("ftruncate");
+    exit(-1);
+  }
+  sdcard_fd = open(image, O_RDWR);
+  if (sdcard_fd < 0) {
+    perror("open");
+    exit(-1);
+  }
+
+  memset(sector_buffer, 0xa5, sizeof(sector_buffer));
+  memset(run_buffer, 0x5a, sizeof(run_buffer));
+
+  printf("%u sectors (%u MiB) on %s\n", sectors, sectors / 2048, image);
+
+  if (check) {
+    n = check_directories(sectors);
+    fclose(f);
+    close(sdcard_fd);
+    unlink(image);
+    return n;
+  }
+
+  if (files) {
+    bench_files(sectors, files);
+    fclose(f);
+    close(sdcard_fd);
+    unlink(image);
+    return 0;
+  }
+
+  printf("Write:\n");
+  t = now();
+  for (n = 0; n < sectors; n++) {
+    fseek(f, n * 512LL, SEEK_SET);
+    fwrite(sector_buffer, 512, 1, f);
+  }
+  fflush(f);
+  report("stdio, 1 sector", sectors, now() - t);
+
+  t = now();
+  for (n = 0; n < sectors; n++)
+    sdcard_writesector(n);
+  report("pwrite, 1 sector", sectors, now() - t);
+
+  t = now();
+  for (n = 0; n + RUN_SECTORS <= sectors; n += RUN_SECTORS)
+    sdcard_writesectors(n, (long)run_buffer, RUN_SECTORS);
+  snprintf(name, sizeof(name), "pwrite, %d sector runs", RUN_SECTORS);
+  report(name, n, now() - t);
+
+  printf("Read:\n");
+  t = now();
+  for (n = 0; n < sectors; n++) {
+    fseek(f, n * 512LL, SEEK_SET);
+    fread(sector_buffer, 512, 1, f);
+  }
+  report("stdio, 1 sector", sectors, now() - t);
+
+  t = now();
+  for (n = 0; n < sectors; n++)
+    sdcard_readsector(n);
+  report("pread, 1 sector", sectors, now() - t);
+
+  t = now();
+  for (n = 0; n + RUN_SECTORS <= sectors; n += RUN_SECTORS)
+    sdcard_readsectors(n, (long)run_buffer, RUN_SECTORS);
+  snprintf(name, sizeof(name), "pread, %d sector runs", RUN_SECTORS);
+  report(name, n, now() - t);
+
+  fclose(f);
+  close(sdcard_fd);
+  unlink(image);
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include "fdisk_hal.h"
 #include "fdisk_memory.h"
 #include "fdisk_screen.h"
+#include "fdisk_progress.h"
 #include "ascii.h"
 
 extern uint32_t root_dir_sector;
@@ -12,6 +13,7 @@ extern uint32_t fat2_sector;
 extern uint32_t reserved_sectors;
 extern uint8_t sectors_per_cluster;
 extern uint32_t fat_sectors;
+extern uint32_t fs_clusters;
 #define fat_copies 2
 #define sectors_per_fat fat_sectors
 #define root_dir_cluster 2
@@ -163,242 +165,642 @@ void getrtc(struct m65_tm *tm)
   }
 }
 
-unsigned long fat32_follow_cluster(unsigned long cluster)
+/*
+  Read cache for FAT, directory and FSInfo sectors, which creating files
+  reads over and over again: the whole root directory and the FSInfo sector
+  for every file, and a FAT sector for every cluster hop of the directory
+  chain. Least recently used sectors make way for new ones.
+
+  Everything the FAT32 code writes goes through fat32_write_meta(), so the
+  cached copies stay current, and the writes of whole FAT runs in
+  fat32_write_chain() drop the sectors they overwrite. The cache is emptied
+  whenever we start on a new file system.
+*/
+uint32_t fat_cache_sector[FAT_CACHE_SECTORS];
+uint32_t fat_cache_used[FAT_CACHE_SECTORS];
+unsigned char fat_cache_valid[FAT_CACHE_SECTORS];
+uint32_t fat_cache_tick = 0;
+
+uint32_t fat32_cache_hits = 0;
+uint32_t fat32_cache_misses = 0;
+
+static unsigned char fc;
+
+#define fat_cache_address(E) (FAT_CACHE_BUFFER + ((long)(E) << 9))
+
+static void fat32_reset_cache(void)
 {
-  unsigned long r;
-  // Read out the cluster number from the FAT
-  sdcard_readsector(fat1_sector + (cluster / 128));
-  r = *((unsigned long *)&sector_buffer[(cluster & 127) << 2]);
-  return r;
+  for (fc = 0; fc < FAT_CACHE_SECTORS; fc++)
+    fat_cache_valid[fc] = 0;
 }
 
-unsigned long fat32_allocate_cluster(unsigned long cluster)
+static void fat32_cache_store(const uint32_t sector_number)
 {
-  unsigned long r;
-  unsigned long fat_sector_num;
-  unsigned short i;
-
-  // Find free cluster
-  for (fat_sector_num = 0; fat_sector_num <= (fat2_sector - fat1_sector); fat_sector_num++) {
-    sdcard_readsector(fat1_sector + fat_sector_num);
-    for (i = 0; i < 512; i += 4) {
-      if (sector_buffer[i])
-        continue;
-      if (sector_buffer[i + 3])
-        continue;
-      if (sector_buffer[i + 1])
-        continue;
-      if (sector_buffer[i + 2])
-        continue;
-    }
-    if (i < 512) {
-      // Found one
-      r = fat_sector_num * 128 + (i >> 2);
-      *((unsigned long *)&sector_buffer[i]) = cluster;
-      sdcard_writesector(fat1_sector + fat_sector_num);
-      sdcard_writesector(fat2_sector + fat_sector_num);
-      return r;
-    }
+  // Remember sector_buffer as the contents of <sector_number>
+  unsigned char victim = 0;
+
+  for (fc = 0; fc < FAT_CACHE_SECTORS; fc++) {
+    if (fat_cache_valid[fc] && fat_cache_sector[fc] == sector_number)
+      break;
+    if (!fat_cache_valid[fc])
+      victim = fc;
+    else if (fat_cache_valid[victim] && fat_cache_used[fc] < fat_cache_used[victim])
+      victim = fc;
   }
+  if (fc == FAT_CACHE_SECTORS)
+    fc = victim;
 
-  return 0;
+  lcopy((long)sector_buffer, fat_cache_address(fc), 512);
+  fat_cache_sector[fc] = sector_number;
+  fat_cache_used[fc] = ++fat_cache_tick;
+  fat_cache_valid[fc] = 1;
 }
 
-/*
-  Create a file in the root directory of the new FAT32 filesystem
-  with the indicated name and size.
+static void fat32_read_meta(const uint32_t sector_number)
+{
+  for (fc = 0; fc < FAT_CACHE_SECTORS; fc++)
+    if (fat_cache_valid[fc] && fat_cache_sector[fc] == sector_number) {
+      lcopy(fat_cache_address(fc), (long)sector_buffer, 512);
+      fat_cache_used[fc] = ++fat_cache_tick;
+      fat32_cache_hits++;
+      return;
+    }
 
-  The file will be created contiguous on disk, and the first
-  sector of the created file returned.
+  fat32_cache_misses++;
+  sdcard_readsector(sector_number);
+  fat32_cache_store(sector_number);
+}
 
-  The root directory is the start of cluster 2, and clusters are
-  assumed to be 4KB in size, to keep things simple.
+static void fat32_write_meta(const uint32_t sector_number)
+{
+  fat32_cache_store(sector_number);
+  sdcard_writesector(sector_number);
+}
+
+static void fat32_forget_meta(const uint32_t first_sector, const uint32_t last_sector)
+{
+  for (fc = 0; fc < FAT_CACHE_SECTORS; fc++)
+    if (fat_cache_sector[fc] >= first_sector && fat_cache_sector[fc] <= last_sector)
+      fat_cache_valid[fc] = 0;
+}
 
-  XXX -- Should allow creation of files in sub-directories
+/*
+  Free space map: the free clusters of the file system as a sorted list of
+  extents [start, end). It is built from FAT1 the first time it is needed
+  after fat32_reset_allocator(), i.e., once per format, and then kept up
+  to date as clusters are allocated, so that we never have to scan the FAT
+  again.
 
+  If we run out of extent slots, the smallest extent is forgotten. That only
+  costs us some free space, never correctness.
 */
-long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, long fat1_sector, long fat2_sector)
+#define FAT32_FREE_EXTENTS 32
+uint32_t free_extent_start[FAT32_FREE_EXTENTS];
+uint32_t free_extent_end[FAT32_FREE_EXTENTS];
+unsigned char free_extent_count = 0;
+
+// Absolute sector numbers of the FATs the free space map describes (0 = no map)
+uint32_t free_map_fat1 = 0;
+uint32_t free_map_fat2 = 0;
+
+void fat32_reset_allocator(void)
 {
-  unsigned char i = 0, sn = 0, len = 0;
-  unsigned short offset = 0, j = 0;
-  unsigned short clusters = 0;
-  unsigned long k, start_cluster = 0;
-  unsigned long dir_cluster = 2;
-  unsigned long last_dir_cluster = 2;
-  //  unsigned long next_cluster;
-  unsigned long contiguous_clusters = 0;
-  unsigned long fat_sector_num = 0;
-  unsigned long fat_sector_count = 0;
-
-  unsigned char have_dir_slot = 0;
-  unsigned long free_dir_sector_num = 0;
-  unsigned short free_dir_sector_ofs = 0;
-  struct m65_tm tm;
+  free_map_fat1 = 0;
+  fat32_reset_cache();
+}
 
-  char message[40] = "Found file: ????????.???";
+static void fat32_insert_free_extent(unsigned char e, uint32_t start, uint32_t end)
+{
+  // Insert extent at index e, keeping the list sorted
+  unsigned char i, smallest;
 
-  clusters = size / (512 * sectors_per_cluster);
-  if (size % (512 * sectors_per_cluster))
-    clusters++;
+  if (free_extent_count == FAT32_FREE_EXTENTS) {
+    smallest = 0;
+    for (i = 1; i < free_extent_count; i++)
+      if (free_extent_end[i] - free_extent_start[i] < free_extent_end[smallest] - free_extent_start[smallest])
+        smallest = i;
+    if (free_extent_end[smallest] - free_extent_start[smallest] >= end - start)
+      return;
+    for (i = smallest; i < free_extent_count - 1; i++) {
+      free_extent_start[i] = free_extent_start[i + 1];
+      free_extent_end[i] = free_extent_end[i + 1];
+    }
+    free_extent_count--;
+    if (e > smallest)
+      e--;
+  }
 
-  // Look for a free directory slot.
-  // Also complain if the file already exists
-  //  mega65_serial_monitor_write("Search for free directory slot\n");
+  for (i = free_extent_count; i > e; i--) {
+    free_extent_start[i] = free_extent_start[i - 1];
+    free_extent_end[i] = free_extent_end[i - 1];
+  }
+  free_extent_start[e] = start;
+  free_extent_end[e] = end;
+  free_extent_count++;
+}
 
-  while (dir_cluster >= 2 && dir_cluster < 0xf0000000) {
-    for (sn = 0; sn < sectors_per_cluster; sn++) {
+static void fat32_take_clusters(unsigned char e, uint32_t start, uint32_t end)
+{
+  // Remove [start, end) from free extent e
+  unsigned char i;
 
-      sdcard_readsector(root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn);
+  if (start == free_extent_start[e] && end == free_extent_end[e]) {
+    free_extent_count--;
+    for (i = e; i < free_extent_count; i++) {
+      free_extent_start[i] = free_extent_start[i + 1];
+      free_extent_end[i] = free_extent_end[i + 1];
+    }
+  }
+  else if (start == free_extent_start[e])
+    free_extent_start[e] = end;
+  else if (end == free_extent_end[e])
+    free_extent_end[e] = start;
+  else {
+    fat32_insert_free_extent(e + 1, end, free_extent_end[e]);
+    free_extent_end[e] = start;
+  }
+}
 
-      for (offset = 0; offset < 512; offset += 32) {
-        for (i = 0; i < 8; i++)
-          message[i] = sector_buffer[offset + i];
-        len = 8;
-        while (len && (message[len] == ' ' || message[len] == 0))
-          len--;
-        message[len++] = '.';
-        for (i = 0; i < 3; i++)
-          message[len + i] = sector_buffer[offset + 8 + i];
-        len += 3;
-        while (len && (message[len] == ' ' || message[len] == 0))
-          len--;
-        if (!strcmp(message, name)) {
-          // ERROR: Name already exists
-          //	  mega65_serial_monitor_write("File already exists\n");
-          return 0;
-        }
+static void fat32_release_clusters(uint32_t start, uint32_t end)
+{
+  // Give [start, end) back to the free extents, merging it with its
+  // neighbours, after the allocation it was taken for fell through
+  unsigned char e, i;
 
-        // Is the slot free?
-        if (sector_buffer[offset] == 0) {
-          free_dir_sector_num = root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn;
-          free_dir_sector_ofs = offset;
-          have_dir_slot = 1;
-          //	  mega65_serial_monitor_write("Found free directory slot:\n");
-          serial_hex(dir_cluster);
-          serial_hex(sn);
-          serial_hex(offset);
-
-          break;
-        }
+  for (e = 0; e < free_extent_count; e++)
+    if (free_extent_start[e] > start)
+      break;
+  if (e && free_extent_end[e - 1] == start) {
+    // Joins the extent before, and maybe the one after as well
+    e--;
+    free_extent_end[e] = end;
+    if (e + 1 < free_extent_count && free_extent_start[e + 1] == end) {
+      free_extent_end[e] = free_extent_end[e + 1];
+      free_extent_count--;
+      for (i = e + 1; i < free_extent_count; i++) {
+        free_extent_start[i] = free_extent_start[i + 1];
+        free_extent_end[i] = free_extent_end[i + 1];
       }
-      if (have_dir_slot)
-        break;
     }
-    // Stop once we have found a free directory slot
-    if (have_dir_slot)
-      break;
+  }
+  else if (e < free_extent_count && free_extent_start[e] == end)
+    free_extent_start[e] = start;
+  else
+    fat32_insert_free_extent(e, start, end);
+}
 
-    // Chain to next directory cluster, and extend directory
-    // if required.
-    last_dir_cluster = dir_cluster;
-    dir_cluster = fat32_follow_cluster(dir_cluster);
-    if ((!dir_cluster) || (dir_cluster >= 0xf0000000)) {
-      // End of directory --
-      dir_cluster = fat32_allocate_cluster(last_dir_cluster);
+/*
+  FS Information sector handling. The FSInfo sector lives in the sector after
+  the boot sector, and its backup copy at partition + 7. It holds the number
+  of free clusters and a hint of where the next free cluster is. We start
+  building the free space map from the hint, and keep both values up to date
+  as we allocate, so that hosts mounting the card don't need to recount.
+*/
+#define FSINFO_SECTOR 1
+#define FSINFO_BACKUP_SECTOR 7
 
-      //      mega65_serial_monitor_write("Allocating new directory cluster");
-      serial_hex(dir_cluster);
+// Clusters allocated since the FSInfo sector was last updated
+uint32_t fsinfo_allocated = 0;
 
-      if ((!dir_cluster) || (dir_cluster >= 0xf0000000)) {
-        // Disk full
-        return 0;
-      }
-      else {
+static unsigned char fat32_fsinfo_valid(void)
+{
+  return sector_buffer[0] == 0x52 && sector_buffer[1] == 0x52 && sector_buffer[2] == 0x61 && sector_buffer[3] == 0x41
+      && sector_buffer[0x1e4] == 0x72 && sector_buffer[0x1e5] == 0x72 && sector_buffer[0x1e6] == 0x41
+      && sector_buffer[0x1e7] == 0x61;
+}
 
-        // Zero out new directory cluster
-        //	mega65_serial_monitor_write("Zeroing out new directory cluster\n");
-        serial_hex(dir_cluster);
-        lfill((unsigned long)sector_buffer, 0, 512);
-        for (sn = 0; sn < sectors_per_cluster; sn++) {
-          sdcard_readsector(root_dir_sector + ((dir_cluster - 2) * sectors_per_cluster) + sn);
-        }
-      }
-    }
+static uint32_t fat32_read_next_free_hint(const uint32_t fat1_sector)
+{
+  uint32_t hint;
+
+  fat32_read_meta(fat1_sector - reserved_sectors + FSINFO_SECTOR);
+  if (!fat32_fsinfo_valid())
+    return 0;
+  hint = *(uint32_t *)&sector_buffer[0x1ec];
+  if (hint < 2 || hint >= fs_clusters)
+    return 0;
+  return hint;
+}
+
+void fat32_update_fsinfo(void)
+{
+  // Account for fsinfo_allocated clusters, and point the next free hint at
+  // the first free cluster we know of.
+  uint32_t partition_start = free_map_fat1 - reserved_sectors;
+  uint32_t free_clusters;
+
+  if (!free_map_fat1 || !fsinfo_allocated)
+    return;
+
+  fat32_read_meta(partition_start + FSINFO_SECTOR);
+  if (!fat32_fsinfo_valid())
+    return;
+
+  free_clusters = *(uint32_t *)&sector_buffer[0x1e8];
+  // 0xffffffff means unknown, which we leave alone
+  if (free_clusters != 0xffffffffUL) {
+    if (free_clusters > fsinfo_allocated)
+      free_clusters -= fsinfo_allocated;
+    else
+      free_clusters = 0;
+    *(uint32_t *)&sector_buffer[0x1e8] = free_clusters;
   }
+  *(uint32_t *)&sector_buffer[0x1ec] = free_extent_count ? free_extent_start[0] : 0xffffffffUL;
 
-  // Find where we have enough contiguous space
-  //  mega65_serial_monitor_write("Search for free disk space\n");
-  contiguous_clusters = 0;
-  start_cluster = 0;
-  for (fat_sector_num = 0; fat_sector_num <= (fat2_sector - fat1_sector); fat_sector_num++) {
+  fat32_write_meta(partition_start + FSINFO_SECTOR);
+  fat32_write_meta(partition_start + FSINFO_BACKUP_SECTOR);
 
-    // This can take a while if the disk is full, because we use a naive search.
-    // So show the user that something is happening.
-    // XXX Use FAT32's hint of first cluster free _and_ then update it!
-    POKE(0xD020, PEEK(0xD020 + 1));
+  fsinfo_allocated = 0;
+}
 
-    sdcard_readsector(fat1_sector + fat_sector_num);
+static void fat32_build_free_map(const uint32_t fat1_sector, const uint32_t fat2_sector)
+{
+  uint32_t cluster, run_start = 0;
+  unsigned short offset;
+  unsigned char in_run = 0;
 
-    // Skip any FAT sectors with allocated clusters
-    for (j = 0; j < 512; j++)
-      if (sector_buffer[j])
+  free_extent_count = 0;
+  fsinfo_allocated = 0;
+  fat32_reset_cache();
+
+  // Everything before the FAT sector holding the next free cluster hint is in use
+  cluster = fat32_read_next_free_hint(fat1_sector) & 0xffffff80UL;
+
+  // This can take a while on a big card, so show the user that something is happening.
+  progress_begin("Scanning FAT", (fs_clusters + 127) >> 7);
+  for (; cluster < fs_clusters; cluster += 128) {
+    progress_update(cluster >> 7);
+
+    // Each FAT sector is only looked at once, so this bypasses the cache
+    sdcard_readsector(fat1_sector + (cluster >> 7));
+
+    // Whole sector free?
+    for (offset = 0; offset < 512; offset++)
+      if (sector_buffer[offset])
         break;
-    if (j != 512) {
-      // Reset count of contiguous clusters
-      contiguous_clusters = 0;
+    if (offset == 512) {
+      if (!in_run)
+        run_start = cluster;
+      in_run = 1;
       continue;
     }
-    else {
-      // Start from here
-      if (!contiguous_clusters)
-        start_cluster = fat_sector_num * 128;
-      contiguous_clusters += 128;
+
+    for (offset = 0; offset < 512 && cluster + (offset >> 2) < fs_clusters; offset += 4) {
+      if (sector_buffer[offset] | sector_buffer[offset + 1] | sector_buffer[offset + 2] | sector_buffer[offset + 3]) {
+        if (in_run)
+          fat32_insert_free_extent(free_extent_count, run_start, cluster + (offset >> 2));
+        in_run = 0;
+      }
+      else if (!in_run) {
+        run_start = cluster + (offset >> 2);
+        in_run = 1;
+      }
     }
-    if (contiguous_clusters >= clusters)
-      break;
   }
+  progress_end();
+  if (in_run)
+    fat32_insert_free_extent(free_extent_count, run_start, fs_clusters);
 
-  // Abort if the disk is full
-  if (contiguous_clusters < clusters) {
-    //    mega65_serial_monitor_write("Could not find free contiguous space\r\n");
+  free_map_fat1 = fat1_sector;
+  free_map_fat2 = fat2_sector;
+}
+
+static uint32_t fat32_extent_end(const uint32_t start, const uint32_t clusters)
+{
+  // End of the clusters a file of <clusters> clusters at <start> owns
+  uint32_t end = (start + clusters + 127) & 0xffffff80UL;
+
+  return end > fs_clusters ? fs_clusters : end;
+}
+
+static uint32_t fat32_allocate_extent(const uint32_t clusters)
+{
+  // Find the first free extent that can hold a file of <clusters> clusters.
+  // Files start on a FAT sector boundary and own all of the FAT sectors
+  // their chain touches, as the chain is written a whole FAT sector at a time.
+  unsigned char e;
+  uint32_t start, end;
+
+  for (e = 0; e < free_extent_count; e++) {
+    start = (free_extent_start[e] + 127) & 0xffffff80UL;
+    end = fat32_extent_end(start, clusters);
+    if (end <= free_extent_end[e] && start + clusters <= end) {
+      fat32_take_clusters(e, start, end);
+      return start;
+    }
+  }
+  return 0;
+}
+
+void fat32_set_cluster(unsigned long cluster, unsigned long value)
+{
+  // Set the FAT entry for <cluster> in both FATs
+  fat32_read_meta(free_map_fat1 + (cluster / 128));
+  *((uint32_t *)&sector_buffer[(cluster & 127) << 2]) = value;
+  fat32_write_meta(free_map_fat1 + (cluster / 128));
+  fat32_write_meta(free_map_fat2 + (cluster / 128));
+}
+
+unsigned long fat32_follow_cluster(unsigned long cluster)
+{
+  unsigned long r;
+  // Read out the cluster number from the FAT
+  fat32_read_meta(free_map_fat1 + (cluster / 128));
+  r = *((uint32_t *)&sector_buffer[(cluster & 127) << 2]) & 0x0fffffff;
+  return r;
+}
+
+unsigned long fat32_allocate_cluster(unsigned long cluster)
+{
+  // Allocate a single cluster, and chain it on from <cluster>, or start a
+  // new chain with it if <cluster> is 0
+  unsigned long r;
+
+  if (!free_extent_count)
     return 0;
+  r = free_extent_start[0];
+  fat32_take_clusters(0, r, r + 1);
+
+  fat32_set_cluster(r, 0x0FFFFFF8);
+  if (cluster)
+    fat32_set_cluster(cluster, r);
+  fsinfo_allocated++;
+
+  return r;
+}
+
+static void fat32_free_cluster(const uint32_t cluster)
+{
+  // Give back a cluster that fat32_allocate_cluster(0) has just allocated
+  fat32_set_cluster(cluster, 0);
+  fsinfo_allocated--;
+  fat32_release_clusters(cluster, cluster + 1);
+}
+
+static void fat32_write_chain(const uint32_t start_cluster, const uint32_t clusters)
+{
+  // Write the chain start_cluster -> start_cluster+1 -> ... -> end of chain
+  // into both FATs. start_cluster is on a FAT sector boundary, and the file
+  // owns all of the FAT sectors the chain touches, so whole sectors are
+  // generated, FAT_CHAIN_SECTORS at a time, and each run is written to both
+  // FATs with one multi-sector write. Those are not read back by the SD card
+  // code, so each run is verified (and bad sectors rewritten) afterwards.
+  uint32_t fat_sector = start_cluster >> 7;
+  uint32_t cluster = start_cluster;
+  uint32_t end_cluster = start_cluster + clusters;
+  uint32_t remaining = (clusters + 127) >> 7;
+  uint16_t offset;
+  unsigned char k, run;
+
+  while (remaining) {
+    run = remaining < FAT_CHAIN_SECTORS ? remaining : FAT_CHAIN_SECTORS;
+    for (k = 0; k < run; k++) {
+      lfill((unsigned long)sector_buffer, 0, 512);
+      for (offset = 0; offset < 512 && cluster < end_cluster; offset += 4) {
+        cluster++;
+        *(uint32_t *)&sector_buffer[offset] = cluster == end_cluster ? 0x0FFFFFF8 : cluster;
+      }
+      lcopy((long)sector_buffer, FAT_CHAIN_BUFFER + ((long)k << 9), 512);
+    }
+    fat32_forget_meta(free_map_fat1 + fat_sector, free_map_fat1 + fat_sector + run - 1);
+    fat32_forget_meta(free_map_fat2 + fat_sector, free_map_fat2 + fat_sector + run - 1);
+    sdcard_writesectors(free_map_fat1 + fat_sector, FAT_CHAIN_BUFFER, run);
+    sdcard_writesectors(free_map_fat2 + fat_sector, FAT_CHAIN_BUFFER, run);
+    sdcard_verifysectors(free_map_fat1 + fat_sector, FAT_CHAIN_BUFFER, run);
+    sdcard_verifysectors(free_map_fat2 + fat_sector, FAT_CHAIN_BUFFER, run);
+    fat_sector += run;
+    remaining -= run;
   }
+}
 
-  //  mega65_serial_monitor_write("Found contiguous space beginning at cluster $");
-  serial_hex(start_cluster);
+/*
+  Directory index: a hash of the raw 11 byte name of every file in the
+  directory we are creating files in, and where its free slots are, built
+  in one pass over the directory and then kept up to date as we add
+  entries. Checking for a duplicate name and finding a slot for the new
+  entry then no longer read the directory at all.
 
-  // Write cluster chain into both FATs
-  //  mega65_serial_monitor_write("Writing FAT sectors for file\r\n");
-  fat_sector_num = start_cluster / 128;
-  //  next_cluster=start_cluster+1;
-  fat_sector_count = clusters / 128;
-  if (clusters & 127)
-    fat_sector_count++;
-  for (k = 0; k <= fat_sector_count; k++) {
-    // Fill FAT sector with chain
-    for (offset = 0; offset < 512; offset += 4) {
-      if (((k << 7) + (offset >> 2)) < clusters) {
-        // Write chain
-        *(unsigned long *)&sector_buffer[offset] = start_cluster + (k << 7) + (offset >> 2) + 1;
+  The hashes are only 16 bits, so a match is confirmed by scanning the
+  directory for the name. If the directory holds more names than the hash
+  table, every check scans the directory, as before.
+*/
+#define DIR_INDEX_SLOTS 512
+#define DIR_INDEX_FREE 8
+uint16_t dir_index_hash[DIR_INDEX_SLOTS];
+uint16_t dir_index_count;
+unsigned char dir_index_full;
+
+// First cluster of the indexed directory (0 = no index), and the sector of
+// cluster 2 that its sector numbers are relative to
+uint32_t dir_index_cluster = 0;
+uint32_t dir_index_data_start;
+
+// Deleted entries that can be reused
+uint32_t dir_free_sector[DIR_INDEX_FREE];
+uint16_t dir_free_offset[DIR_INDEX_FREE];
+unsigned char dir_free_count;
+
+// The first never used entry, which marks the end of the directory. If the
+// directory is full up to the end of its last cluster, dir_end_valid is 0,
+// and the next entry needs a new cluster chained on from dir_last_cluster.
+unsigned char dir_end_valid;
+uint32_t dir_end_cluster;
+unsigned char dir_end_sn;
+uint16_t dir_end_offset;
+uint32_t dir_last_cluster;
+
+// Attributes and first cluster of the entry fat32_scan_directory() found
+unsigned char dir_found_attr;
+uint32_t dir_found_cluster;
+
+#define dir_sector(CLUSTER, SN) (dir_index_data_start + ((CLUSTER)-2) * sectors_per_cluster + (SN))
+
+static char *fat32_raw_name(char *name, unsigned char *raw)
+{
+  // Convert the first component of the path <name>, "NAME.EXT" or an
+  // already padded "NAME    EXT", to its form in a directory entry.
+  // Returns the rest of the path, or NULL if this was the last component.
+  unsigned char i, j;
+
+  for (i = 0; i < 11; i++)
+    raw[i] = ' ';
+  for (i = 0, j = 0; name[j] && name[j] != '/'; j++) {
+    if (name[j] == '.')
+      i = 8;
+    else if (i < 11)
+      raw[i++] = name[j];
+  }
+  return name[j] == '/' ? &name[j + 1] : NULL;
+}
+
+static uint16_t fat32_name_hash(const unsigned char *raw)
+{
+  uint16_t h = 0;
+  unsigned char i;
+
+  for (i = 0; i < 11; i++)
+    h = (h << 5) - h + raw[i];
+  // 0 marks an empty slot
+  return h ? h : 1;
+}
+
+static void fat32_index_add(const unsigned char *raw)
+{
+  uint16_t h = fat32_name_hash(raw), i;
+
+  // Keep a slot empty, so that lookups always end
+  if (dir_index_count == DIR_INDEX_SLOTS - 1) {
+    dir_index_full = 1;
+    return;
+  }
+  for (i = h & (DIR_INDEX_SLOTS - 1); dir_index_hash[i]; i = (i + 1) & (DIR_INDEX_SLOTS - 1))
+    continue;
+  dir_index_hash[i] = h;
+  dir_index_count++;
+}
+
+static unsigned char fat32_index_maybe_has(const unsigned char *raw)
+{
+  uint16_t h = fat32_name_hash(raw), i;
+
+  if (dir_index_full)
+    return 1;
+  for (i = h & (DIR_INDEX_SLOTS - 1); dir_index_hash[i]; i = (i + 1) & (DIR_INDEX_SLOTS - 1))
+    if (dir_index_hash[i] == h)
+      return 1;
+  return 0;
+}
+
+static unsigned char fat32_scan_directory(const unsigned char *raw)
+{
+  // With raw == NULL, build the index of the directory at dir_index_cluster.
+  // Otherwise, return 1 if the directory has a file called <raw>.
+  uint32_t cluster = dir_index_cluster;
+  unsigned char sn;
+  uint16_t offset;
+
+  while (cluster >= 2 && cluster < 0x0ffffff8) {
+    // Lookups can stop in any cluster, so only the full scan says which is last
+    if (!raw)
+      dir_last_cluster = cluster;
+    for (sn = 0; sn < sectors_per_cluster; sn++) {
+      fat32_read_meta(dir_sector(cluster, sn));
+      for (offset = 0; offset < 512; offset += 32) {
+        if (!sector_buffer[offset]) {
+          // Never used, and nothing after it is either
+          if (!raw) {
+            dir_end_valid = 1;
+            dir_end_cluster = cluster;
+            dir_end_sn = sn;
+            dir_end_offset = offset;
+          }
+          return 0;
+        }
+        if (sector_buffer[offset] == 0xe5) {
+          if (!raw && dir_free_count < DIR_INDEX_FREE) {
+            dir_free_sector[dir_free_count] = dir_sector(cluster, sn);
+            dir_free_offset[dir_free_count++] = offset;
+          }
+          continue;
+        }
+        // Neither volume labels nor long file name parts are file names
+        if (sector_buffer[offset + 0x0b] & 0x08)
+          continue;
+        if (!raw)
+          fat32_index_add(&sector_buffer[offset]);
+        else if (!memcmp(&sector_buffer[offset], raw, 11)) {
+          dir_found_attr = sector_buffer[offset + 0x0b];
+          dir_found_cluster = *(uint16_t *)&sector_buffer[offset + 0x14];
+          dir_found_cluster = (dir_found_cluster << 16) | *(uint16_t *)&sector_buffer[offset + 0x1a];
+          return 1;
+        }
       }
-      if (((k << 7) + (offset >> 2)) == (clusters - 1)) {
-        // Mark end of chain
-        *(unsigned long *)&sector_buffer[offset] = 0x0FFFFFF8;
+    }
+    cluster = fat32_follow_cluster(cluster);
+  }
+  return 0;
+}
+
+static void fat32_index_directory(const uint32_t cluster, const uint32_t data_start)
+{
+  uint16_t i;
+
+  for (i = 0; i < DIR_INDEX_SLOTS; i++)
+    dir_index_hash[i] = 0;
+  dir_index_count = 0;
+  dir_index_full = 0;
+  dir_free_count = 0;
+  dir_end_valid = 0;
+  dir_index_cluster = cluster;
+  dir_index_data_start = data_start;
+  fat32_scan_directory(NULL);
+}
+
+static unsigned char fat32_take_dir_slot(uint32_t *sector, uint16_t *offset)
+{
+  // Find a slot for a new entry in the indexed directory, extending it if
+  // needed. Returns 0 if the disk is full.
+  uint32_t cluster;
+  unsigned char sn;
+
+  if (dir_free_count) {
+    dir_free_count--;
+    *sector = dir_free_sector[dir_free_count];
+    *offset = dir_free_offset[dir_free_count];
+    return 1;
+  }
+
+  if (!dir_end_valid) {
+    // Chain on a new, empty cluster
+    cluster = fat32_allocate_cluster(dir_last_cluster);
+    if (!cluster)
+      return 0;
+    lfill((unsigned long)sector_buffer, 0, 512);
+    for (sn = 0; sn < sectors_per_cluster; sn++)
+      fat32_write_meta(dir_sector(cluster, sn));
+    dir_end_valid = 1;
+    dir_end_cluster = cluster;
+    dir_end_sn = 0;
+    dir_end_offset = 0;
+    dir_last_cluster = cluster;
+  }
+
+  *sector = dir_sector(dir_end_cluster, dir_end_sn);
+  *offset = dir_end_offset;
+
+  // The entry after it is the new end of the directory
+  dir_end_offset += 32;
+  if (dir_end_offset == 512) {
+    dir_end_offset = 0;
+    if (++dir_end_sn == sectors_per_cluster) {
+      dir_end_sn = 0;
+      cluster = fat32_follow_cluster(dir_end_cluster);
+      if (cluster >= 2 && cluster < 0x0ffffff8) {
+        dir_end_cluster = cluster;
+        dir_last_cluster = cluster;
       }
+      else
+        dir_end_valid = 0;
     }
-    // Write FAT sector to both FATs
-    sdcard_writesector(fat1_sector + fat_sector_num + k);
-    sdcard_writesector(fat2_sector + fat_sector_num + k);
   }
+  return 1;
+}
+
+static void fat32_build_entry(
+    const uint16_t offset, const unsigned char *raw, const unsigned char attr, const uint32_t cluster, const uint32_t size)
+{
+  // Fill in the directory entry at <offset> in sector_buffer
+  unsigned char i;
+  uint16_t j;
+  struct m65_tm tm;
 
-  // Build directory entry
-  //  mega65_serial_monitor_write("Building directory entry\r\n");
-  sdcard_readsector(free_dir_sector_num);
   // Clear entry
   for (i = 0; i < 32; i++)
-    sector_buffer[free_dir_sector_ofs + i] = 0x00;
+    sector_buffer[offset + i] = 0x00;
   // Write name
-  // Fill name with space
   for (i = 0; i < 11; i++)
-    sector_buffer[free_dir_sector_ofs + i] = 0x20;
-  // Then overwrite with actual name
-  for (i = 0, j = 0; i < 11; i++, j++) {
-    if (name[j] == '.')
-      i = 7;
-    else
-      sector_buffer[free_dir_sector_ofs + i] = name[j];
-  }
-  sector_buffer[free_dir_sector_ofs + 0x0b] = 0x20; // Archive bit set
+    sector_buffer[offset + i] = raw[i];
+  sector_buffer[offset + 0x0b] = attr;
 
   //  mega65_serial_monitor_write("Getting RTC timestamp\r\n");
   getrtc(&tm);
@@ -408,32 +810,295 @@ long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, l
   j |= (tm.tm_min << 5);
   j |= (tm.tm_sec >> 1);
   // Create time 0x0e -- 0x0f
-  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x0e] = j;
+  *(unsigned short *)&sector_buffer[offset + 0x0e] = j;
   // Modify time 0x16 -- 0x17
-  //  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x16]=j;
+  //  *(unsigned short *)&sector_buffer[offset + 0x16]=j;
   j = ((tm.tm_year - 80) << 9); // DOS is based on 1980, tm struct on 1900
   j |= (tm.tm_mon << 5);
   j |= tm.tm_mday;
   // Create date 0x10 -- 0x11
-  *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x10] = j;
+  *(unsigned short *)&sector_buffer[offset + 0x10] = j;
   // Modify date 0x18 -- 0x19
-  // *(unsigned short *)&sector_buffer[free_dir_sector_ofs + 0x18]=j;
+  // *(unsigned short *)&sector_buffer[offset + 0x18]=j;
   // Start cluster
-  sector_buffer[free_dir_sector_ofs + 0x1A] = start_cluster;
-  sector_buffer[free_dir_sector_ofs + 0x1B] = start_cluster >> 8;
-  sector_buffer[free_dir_sector_ofs + 0x14] = start_cluster >> 16;
-  sector_buffer[free_dir_sector_ofs + 0x15] = start_cluster >> 24;
+  sector_buffer[offset + 0x1A] = cluster;
+  sector_buffer[offset + 0x1B] = cluster >> 8;
+  sector_buffer[offset + 0x14] = cluster >> 16;
+  sector_buffer[offset + 0x15] = cluster >> 24;
   // File length
-  sector_buffer[free_dir_sector_ofs + 0x1C] = (size >> 0) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1D] = (size >> 8L) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1E] = (size >> 16L) & 0xff;
-  sector_buffer[free_dir_sector_ofs + 0x1F] = (size >> 24l) & 0xff;
+  sector_buffer[offset + 0x1C] = (size >> 0) & 0xff;
+  sector_buffer[offset + 0x1D] = (size >> 8L) & 0xff;
+  sector_buffer[offset + 0x1E] = (size >> 16L) & 0xff;
+  sector_buffer[offset + 0x1F] = (size >> 24l) & 0xff;
+}
+
+static uint32_t fat32_make_directory(const unsigned char *raw)
+{
+  // Create the directory <raw> in the indexed directory, and return its
+  // first cluster, or 0 if the disk is full.
+  uint32_t cluster, parent = dir_index_cluster;
+  uint32_t slot_sector;
+  uint16_t slot_offset;
+  unsigned char sn;
+  static const unsigned char dot[11] = { '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+  static const unsigned char dotdot[11] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+
+  // As for files, allocate before taking the directory slot
+  cluster = fat32_allocate_cluster(0);
+  if (!cluster)
+    return 0;
+  if (!fat32_take_dir_slot(&slot_sector, &slot_offset)) {
+    fat32_free_cluster(cluster);
+    return 0;
+  }
+  fat32_index_add(raw);
+
+  fat32_read_meta(slot_sector);
+  fat32_build_entry(slot_offset, raw, 0x10, cluster, 0);
+  fat32_write_meta(slot_sector);
+
+  // An empty directory is just "." and "..", which points at cluster 0 when
+  // the parent is the root directory.
+  lfill((unsigned long)sector_buffer, 0, 512);
+  for (sn = 1; sn < sectors_per_cluster; sn++)
+    fat32_write_meta(dir_sector(cluster, sn));
+  fat32_build_entry(0, dot, 0x10, cluster, 0);
+  fat32_build_entry(32, dotdot, 0x10, parent == root_dir_cluster ? 0 : parent, 0);
+  fat32_write_meta(dir_sector(cluster, 0));
+
+  return cluster;
+}
+
+static char *fat32_open_path(char *path, const uint32_t data_start)
+{
+  // Index the directory that the last component of <path> belongs in,
+  // creating any directories on the way that do not exist yet. Returns the
+  // last component, or NULL if the disk is full, or a file is in the way.
+  unsigned char raw[11];
+  uint32_t cluster = root_dir_cluster;
+  char *rest;
+
+  while (1) {
+    if (dir_index_cluster != cluster || dir_index_data_start != data_start)
+      fat32_index_directory(cluster, data_start);
+    rest = fat32_raw_name(path, raw);
+    if (!rest)
+      return path;
+
+    if (fat32_index_maybe_has(raw) && fat32_scan_directory(raw)) {
+      if (!(dir_found_attr & 0x10))
+        return NULL;
+      cluster = dir_found_cluster ? dir_found_cluster : root_dir_cluster;
+    }
+    else {
+      cluster = fat32_make_directory(raw);
+      if (!cluster)
+        return NULL;
+    }
+    path = rest;
+  }
+}
+
+/*
+  Create a file with the indicated name and size in the new FAT32
+  filesystem. The name can be a path, e.g., "GAMES/ARCADE/GAME.D81", and
+  any directories on the way that do not exist yet are created as well, so
+  that a whole tree can be laid out in one pass. Creating files grouped by
+  directory saves indexing the same directory again.
+
+  The file will be created contiguous on disk, and the first
+  sector of the created file returned.
+
+  root_dir_sector is the start of cluster 2, i.e., of the root
+  directory, and clusters are assumed to be 4KB in size, to keep
+  things simple.
+*/
+long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, long fat1_sector, long fat2_sector)
+{
+  unsigned short clusters = 0;
+  unsigned long start_cluster = 0;
+  unsigned char raw_name[11];
+
+  uint32_t free_dir_sector_num = 0;
+  uint16_t free_dir_sector_ofs = 0;
+
+  clusters = size / (512 * sectors_per_cluster);
+  if (size % (512 * sectors_per_cluster))
+    clusters++;
+
+  // New file system?
+  if (free_map_fat1 != fat1_sector) {
+    fat32_build_free_map(fat1_sector, fat2_sector);
+    dir_index_cluster = 0;
+  }
+
+  // Find (or make) the directory, and complain if the file already exists
+  name = fat32_open_path(name, root_dir_sector);
+  if (!name)
+    return 0;
+  fat32_raw_name(name, raw_name);
+  if (fat32_index_maybe_has(raw_name) && fat32_scan_directory(raw_name))
+    return 0;
 
-  sdcard_writesector(free_dir_sector_num);
+  // Find where we have enough contiguous space. This comes before taking a
+  // directory slot, as an unused slot past the end of the directory would
+  // hide all the entries after it.
+  start_cluster = fat32_allocate_extent(clusters);
+
+  // Abort if the disk is full
+  if (!start_cluster)
+    return 0;
+
+  // Look for a free directory slot, extending the directory if required.
+  // Without one, the extent goes back to the free ones.
+  if (!fat32_take_dir_slot(&free_dir_sector_num, &free_dir_sector_ofs)) {
+    fat32_release_clusters(start_cluster, fat32_extent_end(start_cluster, clusters));
+    return 0;
+  }
+  fat32_index_add(raw_name);
+
+  //  mega65_serial_monitor_write("Found contiguous space beginning at cluster $");
+  serial_hex(start_cluster);
+  fsinfo_allocated += clusters;
+
+  // Write cluster chain into both FATs
+  //  mega65_serial_monitor_write("Writing FAT sectors for file\r\n");
+  fat32_write_chain(start_cluster, clusters);
+
+  // Build directory entry, with the archive bit set
+  //  mega65_serial_monitor_write("Building directory entry\r\n");
+  fat32_read_meta(free_dir_sector_num);
+  fat32_build_entry(free_dir_sector_ofs, raw_name, 0x20, start_cluster, size);
+  fat32_write_meta(free_dir_sector_num);
   //  mega65_serial_monitor_write("Wrote DIR sector $");
   serial_hex(free_dir_sector_num);
   //  mega65_serial_monitor_write("@ offset $");
   serial_hex(free_dir_sector_ofs);
 
+  fat32_update_fsinfo();
+
   return root_dir_sector + (start_cluster - 2) * 8;
 }
+
+long fat32_create_directory(char *path, long root_dir_sector, long fat1_sector, long fat2_sector)
+{
+  // Create the directory <path>, and any directories on the way to it.
+  // Returns its first cluster, or 0 if a file is in the way, or the disk
+  // is full. It is not an error if it exists already.
+  unsigned char raw[11];
+  uint32_t cluster;
+
+  if (free_map_fat1 != fat1_sector) {
+    fat32_build_free_map(fat1_sector, fat2_sector);
+    dir_index_cluster = 0;
+  }
+
+  path = fat32_open_path(path, root_dir_sector);
+  if (!path)
+    return 0;
+  fat32_raw_name(path, raw);
+  if (fat32_index_maybe_has(raw) && fat32_scan_directory(raw))
+    return (dir_found_attr & 0x10) ? dir_found_cluster : 0;
+
+  cluster = fat32_make_directory(raw);
+  fat32_update_fsinfo();
+  return cluster;
+}
+
+#ifndef __CC65__
+/*
+  Bulk population (host only). All files of a batch share one extent, back
+  to back, instead of each starting on a FAT sector boundary of its own,
+  and their FAT chains are generated as the files are added, and written
+  BATCH_FAT_SECTORS at a time. Directories are created as needed, from the
+  free space outside the extent.
+*/
+#define BATCH_FAT_SECTORS 256
+
+static uint32_t batch_fat[BATCH_FAT_SECTORS * 128];
+// First FAT sector (relative to the FAT) held in batch_fat
+static uint32_t batch_fat_first;
+static uint32_t batch_next_cluster, batch_end_cluster;
+static long batch_data_start;
+
+static void fat32_batch_flush(const uint32_t sectors)
+{
+  if (!sectors)
+    return;
+  fat32_forget_meta(free_map_fat1 + batch_fat_first, free_map_fat1 + batch_fat_first + sectors - 1);
+  fat32_forget_meta(free_map_fat2 + batch_fat_first, free_map_fat2 + batch_fat_first + sectors - 1);
+  sdcard_writesectors(free_map_fat1 + batch_fat_first, (long)batch_fat, sectors);
+  sdcard_writesectors(free_map_fat2 + batch_fat_first, (long)batch_fat, sectors);
+  sdcard_verifysectors(free_map_fat1 + batch_fat_first, (long)batch_fat, sectors);
+  sdcard_verifysectors(free_map_fat2 + batch_fat_first, (long)batch_fat, sectors);
+}
+
+unsigned char fat32_batch_begin(const uint32_t clusters, long root_dir_sector, long fat1_sector, long fat2_sector)
+{
+  // Reserve an extent for <clusters> clusters of files. Returns 0 if there
+  // is no free extent that big.
+  if (free_map_fat1 != fat1_sector) {
+    fat32_build_free_map(fat1_sector, fat2_sector);
+    dir_index_cluster = 0;
+  }
+
+  batch_next_cluster = clusters ? fat32_allocate_extent(clusters) : 0;
+  if (clusters && !batch_next_cluster)
+    return 0;
+  batch_end_cluster = batch_next_cluster + clusters;
+  batch_fat_first = batch_next_cluster >> 7;
+  batch_data_start = root_dir_sector;
+  memset(batch_fat, 0, sizeof(batch_fat));
+  return 1;
+}
+
+long fat32_batch_add_file(char *name, long size)
+{
+  // As fat32_create_contiguous_file(), but with the clusters taken from the
+  // batch extent. For an empty file, returns the start of cluster 2.
+  uint32_t clusters, start_cluster, cluster;
+  uint32_t dir_sector_num;
+  uint16_t dir_sector_ofs;
+  unsigned char raw_name[11];
+
+  clusters = (size + 512 * sectors_per_cluster - 1) / (512 * sectors_per_cluster);
+  if (batch_next_cluster + clusters > batch_end_cluster)
+    return 0;
+
+  name = fat32_open_path(name, batch_data_start);
+  if (!name)
+    return 0;
+  fat32_raw_name(name, raw_name);
+  if (fat32_index_maybe_has(raw_name) && fat32_scan_directory(raw_name))
+    return 0;
+  if (!fat32_take_dir_slot(&dir_sector_num, &dir_sector_ofs))
+    return 0;
+  fat32_index_add(raw_name);
+
+  start_cluster = clusters ? batch_next_cluster : 0;
+  for (cluster = batch_next_cluster; cluster < batch_next_cluster + clusters; cluster++) {
+    if ((cluster >> 7) >= batch_fat_first + BATCH_FAT_SECTORS) {
+      fat32_batch_flush(BATCH_FAT_SECTORS);
+      batch_fat_first += BATCH_FAT_SECTORS;
+      memset(batch_fat, 0, sizeof(batch_fat));
+    }
+    batch_fat[cluster - (batch_fat_first << 7)] = cluster + 1 == batch_next_cluster + clusters ? 0x0FFFFFF8 : cluster + 1;
+  }
+  batch_next_cluster += clusters;
+  fsinfo_allocated += clusters;
+
+  fat32_read_meta(dir_sector_num);
+  fat32_build_entry(dir_sector_ofs, raw_name, 0x20, start_cluster, size);
+  fat32_write_meta(dir_sector_num);
+
+  return batch_data_start + (start_cluster ? start_cluster - 2 : 0) * sectors_per_cluster;
+}
+
+void fat32_batch_end(void)
+{
+  // Write the rest of the FAT chains, up to the last cluster used
+  if (batch_next_cluster > (batch_fat_first << 7))
+    fat32_batch_flush(((batch_next_cluster - 1) >> 7) - batch_fat_first + 1);
+  fat32_update_fsinfo();
+}
+#endif
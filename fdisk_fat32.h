@@ -1 +1,13 @@
 long fat32_create_contiguous_file(char *name, long size, long root_dir_sector, long fat1_sector, long fat2_sector);
+long fat32_create_directory(char *path, long root_dir_sector, long fat1_sector, long fat2_sector);
+void fat32_reset_allocator(void);
+void fat32_update_fsinfo(void);
+#ifndef __CC65__
+unsigned char fat32_batch_begin(const uint32_t clusters, long root_dir_sector, long fat1_sector, long fat2_sector);
+long fat32_batch_add_file(char *name, long size);
+void fat32_batch_end(void);
+#endif
+
+// Read cache for FAT, directory and FSInfo sectors
+extern uint32_t fat32_cache_hits;
+extern uint32_t fat32_cache_misses;
@@ -5,16 +5,50 @@
 extern uint8_t sector_buffer[512];
 extern unsigned char sdhc_card;
 
+// Counters kept by both HALs, and shown at the end of formatting
+struct sdcard_stats {
+  uint32_t sectors_read;
+  uint32_t flash_reads;
+  uint32_t sectors_written;
+  uint32_t sectors_erased;
+  uint32_t retries;         // Read or write attempts that had to be repeated
+  uint32_t resets;          // SD card resets
+  uint32_t verify_failures; // Sectors that did not read back as written
+  uint32_t busy_us;         // Time spent waiting for the SD card (or device)
+};
+extern struct sdcard_stats sdcard_stats;
+
 uint32_t sdcard_getsize(void);
 void sdcard_open(void);
 void sdcard_writesector(const uint32_t sector_number);
 void sdcard_readsector(const uint32_t sector_number);
+// Multi-sector transfers of <count> consecutive sectors to/from the buffer at
+// <buffer_address> (an lcopy() style address). May use sector_buffer as scratch.
+void sdcard_readsectors(const uint32_t first_sector, const long buffer_address, const uint16_t count);
+void sdcard_writesectors(const uint32_t first_sector, const long buffer_address, const uint16_t count);
+// Read back <count> sectors and compare them with the buffer they were written
+// from. Sectors that differ are rewritten one at a time with the verified
+// single sector path. Returns the number of sectors that had to be rewritten.
+uint16_t sdcard_verifysectors(const uint32_t first_sector, const long buffer_address, const uint16_t count);
 void flash_readsector(const uint32_t sector_number);
 void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector);
 void mega65_fast(void);
 void sdcard_map_sector_buffer(void);
 void multisector_write_test(void);
-void sdcard_readspeed_test(void);
+uint16_t sdcard_readspeed_test(void);
 void sdcard_select(unsigned char n);
+// sdcard_getsize() remembers the size of the card on each bus until the card
+// fails to reset, or this is called (e.g., when rescanning).
+void sdcard_forget_size(unsigned char n);
 unsigned char mega65_getkey(void);
 unsigned char sdcard_reset(void);
+// Free running timer in (approximately) microseconds, for throughput reports.
+// Wraps around after about 71 minutes, so only differences are meaningful.
+uint32_t timer_read_us(void);
+
+#ifndef __CC65__
+// Host build only: target device / image and how to open it
+extern char *sdcard_path;
+extern int sdcard_open_flags;
+extern uint64_t sdcard_size_override;
+#endif
@@ -2,8 +2,12 @@
 #include <stdlib.h>
 
 #include "fdisk_hal.h"
+#include "fdisk_known.h"
+#include "fdisk_trace.h"
+#include "fdisk_wcache.h"
 #include "fdisk_memory.h"
 #include "fdisk_screen.h"
+#include "fdisk_progress.h"
 #include "ascii.h"
 
 #define POKE(X, Y) (*(unsigned char *)(X)) = Y
@@ -27,9 +31,22 @@ unsigned char mega65_getkey(void)
   return key;
 }
 
+// Card sizes found by sdcard_getsize(), per bus, so that each card is only
+// probed once. 0 = not probed yet.
+static uint32_t sdcard_size_cache[2] = { 0, 0 };
+static unsigned char sdcard_bus = 0;
+static uint16_t probe_count;
+
+void sdcard_forget_size(unsigned char n)
+{
+  sdcard_size_cache[n & 1] = 0;
+}
+
 void sdcard_select(unsigned char n)
 {
   POKE(sd_ctl, 0xc0 + (n & 1));
+  sdcard_bus = n & 1;
+  known_reset();
 }
 
 void usleep(uint32_t micros)
@@ -46,12 +63,31 @@ void usleep(uint32_t micros)
   return;
 }
 
+struct sdcard_stats sdcard_stats;
+
+// Time spent waiting for the SD card is accumulated between busy_begin()
+// and busy_end()
+static uint32_t busy_since;
+#define busy_begin() busy_since = timer_read_us()
+#define busy_end() sdcard_stats.busy_us += timer_read_us() - busy_since
+
+static void sdcard_wait_ready(void)
+{
+  if (!(PEEK(sd_ctl) & 3))
+    return;
+  busy_begin();
+  while (PEEK(sd_ctl) & 3)
+    continue;
+  busy_end();
+}
+
 long reset_timeout;
 
 unsigned char sdcard_reset(void)
 {
   // Reset and release reset
   //  write_line("Resetting SD card...",0);
+  sdcard_stats.resets++;
 
   // Clear SDHC flag
   POKE(sd_ctl, 0x40);
@@ -65,8 +101,11 @@ unsigned char sdcard_reset(void)
   while (PEEK(sd_ctl) & 3) {
     POKE(0xd020, (PEEK(0xd020) + 1) & 15);
     reset_timeout--;
-    if (!reset_timeout)
+    if (!reset_timeout) {
+      // Whatever is in the slot now may not be the card we probed
+      sdcard_size_cache[sdcard_bus] = 0;
       return 0xff;
+    }
   }
 
   // Set SDHC flag, since we don't support SDC cards any more
@@ -83,47 +122,60 @@ void mega65_fast(void)
 void show_card_size(uint32_t sector_number)
 {
   // Work out size in MB and tell user
-  char col = 8;
-  uint32_t megs = (sector_number + 1L) / 2048L;
-  uint32_t gigs = 0;
-  if (megs & 0xffff0000L) {
-    gigs = megs / 1024L;
-    megs = gigs;
-  }
-  screen_decimal(screen_line_address + 2, megs);
-  if (megs < 10000)
-    col = 7;
-  if (megs < 1000)
-    col = 6;
-  if (megs < 100)
-    col = 5;
-  if (!gigs)
-    write_line("MiB SD CARD FOUND.", col);
-  else
-    write_line("GiB SD CARD FOUND.", col);
+  unsigned char digits = screen_decimal(screen_line_address + 2, (sector_number + 1L) / 2048L);
+  write_line("MiB SD CARD FOUND.", 3 + digits);
+}
+
+#ifndef LINEAR_SIZE_PROBE
+static unsigned char sdcard_probe(const uint32_t sector_number)
+{
+  // Returns non-zero if <sector_number> can be read
+  probe_count++;
+  sdcard_readsector(sector_number);
+  if (!(PEEK(sd_ctl) & 0x63))
+    return 1;
+
+  // Reading past the end of the card leaves the controller in an error state.
+  // A good read is usually enough to clear it, which is much quicker than
+  // resetting and re-initialising the card, so only reset if that fails too.
+  probe_count++;
+  sdcard_readsector(0);
+  if (PEEK(sd_ctl) & 0x63)
+    sdcard_reset();
+  return 0;
 }
+#endif
 
 uint32_t sdcard_getsize(void)
 {
   // Work out the largest sector number we can read without an error
 
-  uint32_t sector_number = 0x00200000U;
-  uint32_t step = 0x00200000U;
-
+  uint32_t sector_number;
+  uint32_t step;
+  uint32_t start;
+#ifdef LINEAR_SIZE_PROBE
   char result;
+#endif
+
+  if (sdcard_size_cache[sdcard_bus]) {
+    show_card_size(sdcard_size_cache[sdcard_bus]);
+    return sdcard_size_cache[sdcard_bus];
+  }
 
   // Work out if it is SD or SDHC first of all
   // SD cards can't read at non-sector aligned addresses
   if (sdcard_reset())
     return 0;
 
+  probe_count = 0;
+  start = timer_read_us();
+
   // SDHC claims 32GB limit, and reading from beyond that might cause
   // trouble. However, 32bits x 512byte sectors = 16TiB addressable.
   // It thus seems that the top byte of the address may not be safe to use,
-  // or at least the top few bits.
-  sector_number = 0x02000000U;
-  step = sector_number;
+  // or at least the top few bits, so we never look beyond 0x10000000.
 
+#ifdef LINEAR_SIZE_PROBE
   // Work out size of SD card in a safe way
   // (binary search of sector numbers is NOT safe for some reason.
   //  It frequently reports bigger than the size of the card)
@@ -132,6 +184,7 @@ uint32_t sdcard_getsize(void)
   while (sector_number < 0x10000000U) {
     //    write_line("Trying to read sector $",0);
     //    screen_hex(screen_line_address-80+24,sector_number);
+    probe_count++;
     sdcard_readsector(sector_number);
     result = PEEK(sd_ctl) & 0x63;
     if (result) {
@@ -155,16 +208,42 @@ uint32_t sdcard_getsize(void)
     POKE(0xD020U, PEEK(0xD020U) + 1);
     screen_line_address -= 80;
   }
+#else
+  // Double the size from 1MiB until a read fails, always probing upwards
+  // from sectors we know are readable, as the linear search did. Then
+  // bisect between the last good and first bad sector.
+  sector_number = 0;
+  step = 2048;
+  while (step < 0x10000000U && sdcard_probe(step - 1)) {
+    sector_number = step - 1;
+    step = step << 1;
+    POKE(0xD020U, PEEK(0xD020U) + 1);
+  }
+  while (step - sector_number > 1) {
+    if (sdcard_probe(sector_number + ((step - sector_number) >> 1)))
+      sector_number += (step - sector_number) >> 1;
+    else
+      step = sector_number + ((step - sector_number) >> 1);
+    POKE(0xD020U, PEEK(0xD020U) + 1);
+  }
+#endif
 
-  // Report number of sectors
+  // Report number of sectors, and how long it took to find out
+  start = (timer_read_us() - start) / 1000;
   write_line("Maximum readable sector is $", 2);
   screen_hex(screen_line_address - 80 + 30, sector_number);
+  write_line("Probed with       reads in      .   sec", 2);
+  screen_decimal(screen_line_address - 80 + 14, probe_count);
+  screen_decimal(screen_line_address - 80 + 27, start / 1000);
+  lpoke(screen_line_address - 80 + 33, '0' + (start % 1000) / 100);
+  lpoke(screen_line_address - 80 + 34, '0' + (start % 100) / 10);
   //  screen_decimal(screen_line_address,sector_number/1024L);
   //  write_line("K Sector SD CARD.",6);
 
   // Work out size in MB and tell user
   show_card_size(sector_number);
 
+  sdcard_size_cache[sdcard_bus] = sector_number;
   return sector_number;
 }
 
@@ -173,8 +252,6 @@ void sdcard_open(void)
   sdcard_reset();
 }
 
-uint32_t write_count = 0;
-
 void sdcard_map_sector_buffer(void)
 {
   m65_io_enable();
@@ -225,6 +302,7 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
     POKE(sd_ctl, cmd);
 
     // Wait for read to complete
+    busy_begin();
     timeout = 50000U;
     while (PEEK(sd_ctl) & 0x3) {
       timeout--;
@@ -240,12 +318,18 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
         return;
     }
 
+    busy_end();
+
     // Note result
     // result=PEEK(sd_ctl);
 
     if (!(PEEK(sd_ctl) & 0x67)) {
       // Copy data from hardware sector buffer via DMA
       lcopy(sd_sectorbuffer, (long)sector_buffer, 512);
+      if (cmd == 0x53)
+        sdcard_stats.flash_reads++;
+      else
+        sdcard_stats.sectors_read++;
 
       return;
     }
@@ -256,20 +340,37 @@ void do_read_sector(unsigned char cmd, uint32_t sector_number)
     sdcard_open();
 
     tries++;
+    sdcard_stats.retries++;
   }
 }
 
 void sdcard_readsector(const uint32_t sector_number)
 {
-
+  trace_op(TRACE_READ, sector_number, 1);
+  if (wcache_read(sector_number))
+    return;
   do_read_sector(0x02, sector_number);
 }
 
 void flash_readsector(const uint32_t sector_number)
 {
+  trace_op(TRACE_FLASH, sector_number, 1);
   do_read_sector(0x53, sector_number);
 }
 
+void sdcard_readsectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  uint16_t n;
+
+  wcache_flush_range(first_sector, first_sector + count - 1);
+  trace_op(TRACE_READ, first_sector, count);
+
+  for (n = 0; n < count; n++) {
+    do_read_sector(0x02, first_sector + n);
+    lcopy((long)sector_buffer, buffer_address + ((long)n << 9), 512);
+  }
+}
+
 uint8_t verify_buffer[512];
 
 void sdcard_writesector(const uint32_t sector_number)
@@ -280,9 +381,11 @@ void sdcard_writesector(const uint32_t sector_number)
   char tries = 0, result;
   uint16_t counter = 0;
 
-  while (PEEK(sd_ctl) & 3) {
-    continue;
-  }
+  trace_op(TRACE_WRITE, sector_number, 1);
+  if (wcache_write(sector_number))
+    return;
+
+  sdcard_wait_ready();
 
   // Set address to read/write
   POKE(sd_ctl, 1); // end reset
@@ -292,25 +395,34 @@ void sdcard_writesector(const uint32_t sector_number)
   POKE(sd_addr + 2, (sector_address >> 16) & 0xff);
   POKE(sd_addr + 3, (sector_address >> 24) & 0xff);
 
-  // Read the sector and see if it already has the correct contents.
-  // If so, nothing to write
+  // See if the sector already has the correct contents, in which case there
+  // is nothing to write. If we already know the answer, we can skip reading it.
+  switch (known_check(sector_number)) {
+  case KNOWN_SAME:
+    known_reads_saved++;
+    known_writes_elided++;
+    return;
+  case KNOWN_DIFFERENT:
+    known_reads_saved++;
+    break;
+  default:
+    POKE(sd_ctl, 2); // read the sector we just wrote
 
-  POKE(sd_ctl, 2); // read the sector we just wrote
+    sdcard_wait_ready();
 
-  while (PEEK(sd_ctl) & 3) {
-    continue;
-  }
+    // Copy the read data to a buffer for verification
+    lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
 
-  // Copy the read data to a buffer for verification
-  lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
-
-  // VErify that it matches the data we wrote
-  for (i = 0; i < 512; i++) {
-    if (sector_buffer[i] != verify_buffer[i])
-      break;
-  }
-  if (i == 512) {
-    return;
+    // VErify that it matches the data we wrote
+    for (i = 0; i < 512; i++) {
+      if (sector_buffer[i] != verify_buffer[i])
+        break;
+    }
+    if (i == 512) {
+      known_writes_elided++;
+      known_note_write(sector_number);
+      return;
+    }
   }
 
   while (tries < 10) {
@@ -319,6 +431,7 @@ void sdcard_writesector(const uint32_t sector_number)
     lcopy((long)sector_buffer, sd_sectorbuffer, 512);
 
     // Wait for SD card to be ready
+    busy_begin();
     counter = 0;
     while (PEEK(sd_ctl) & 3) {
       counter++;
@@ -338,6 +451,8 @@ void sdcard_writesector(const uint32_t sector_number)
       //	POKE(0x804f,1+(PEEK(0x804f)&0x7f));
     }
 
+    busy_end();
+
     // Command write
     if (sector_number)
       POKE(sd_ctl, 0x57); // open SD card write gate
@@ -349,6 +464,7 @@ void sdcard_writesector(const uint32_t sector_number)
       continue;
 
     // Wait for write to complete
+    busy_begin();
     counter = 0;
     while (PEEK(sd_ctl) & 3) {
       counter++;
@@ -368,16 +484,15 @@ void sdcard_writesector(const uint32_t sector_number)
       //	POKE(0x809f,1+(PEEK(0x809f)&0x7f));
     }
 
-    write_count++;
-    POKE(0xD020, write_count & 0x0f);
+    busy_end();
 
     // Note result
     result = PEEK(sd_ctl);
 
     if (!(PEEK(sd_ctl) & 0x67)) {
-      write_count++;
+      sdcard_stats.sectors_written++;
 
-      POKE(0xD020, write_count & 0x0f);
+      POKE(0xD020, sdcard_stats.sectors_written & 0x0f);
 
       // There is a bug in the SD controller: You have to read between writes, or it
       // gets really upset.
@@ -386,9 +501,7 @@ void sdcard_writesector(const uint32_t sector_number)
 
       // Does it just need some time between accesses?
 
-      while (PEEK(sd_ctl) & 3) {
-        continue;
-      }
+      sdcard_wait_ready();
 
       POKE(sd_ctl, 2); // read the sector we just wrote
 
@@ -396,9 +509,7 @@ void sdcard_writesector(const uint32_t sector_number)
         continue;
       }
 
-      while (PEEK(sd_ctl) & 3) {
-        continue;
-      }
+      sdcard_wait_ready();
 
       // Copy the read data to a buffer for verification
       lcopy(sd_sectorbuffer, (long)verify_buffer, 512);
@@ -410,6 +521,7 @@ void sdcard_writesector(const uint32_t sector_number)
       }
       if (i != 512) {
         // VErify error has occurred
+        sdcard_stats.verify_failures++;
         write_line("Verify error for sector $$$$$$$$", 0);
         screen_hex(screen_line_address - 80 + 24, sector_number);
       }
@@ -418,26 +530,159 @@ void sdcard_writesector(const uint32_t sector_number)
         //      screen_hex(screen_line_address-80+2+14,sector_number);
         //      screen_hex(screen_line_address-80+2+30,result);
 
+        known_note_write(sector_number);
         return;
       }
     }
 
     POKE(0xd020, (PEEK(0xd020) + 1) & 0xf);
+    tries++;
+    sdcard_stats.retries++;
   }
 
   write_line("Write error @ $$$$$$$$$", 2);
   screen_hex(screen_line_address - 80 + 2 + 16, sector_number);
+  known_forget(sector_number, sector_number);
+}
+
+void sdcard_writesectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  // Write the run as one multi-sector write, which saves the command
+  // round trip and read-back verify for every sector. If the SD card reports
+  // an error part way through, the rest of the run is written one sector at a
+  // time, with the usual retries and verification.
+  uint16_t n;
+  uint32_t sector_number;
+
+  trace_op(TRACE_WRITE, first_sector, count);
+  wcache_drop(first_sector, first_sector + count - 1);
+  if (count < 2) {
+    if (count) {
+      lcopy(buffer_address, (long)sector_buffer, 512);
+      wcache_write_through(first_sector);
+    }
+    return;
+  }
+
+  known_forget(first_sector, first_sector + count - 1);
+
+  POKE(sd_addr + 0, (first_sector >> 0) & 0xff);
+  POKE(sd_addr + 1, (first_sector >> 8) & 0xff);
+  POKE(sd_addr + 2, (first_sector >> 16) & 0xff);
+  POKE(sd_addr + 3, (first_sector >> 24) & 0xff);
+
+  for (n = 0; n < count; n++) {
+    sector_number = first_sector + n;
+
+    // Wait for SD card to go ready
+    sdcard_wait_ready();
+
+    lcopy(buffer_address + ((long)n << 9), sd_sectorbuffer, 512);
+
+    if (sector_number)
+      POKE(sd_ctl, 0x57); // open SD card write gate
+    else
+      POKE(sd_ctl, 0x4D); // open SD card write gate for MBR
+    if (!n)
+      POKE(sd_ctl, 0x04); // First sector of multi-sector write
+    else if (n == count - 1)
+      POKE(sd_ctl, 0x06); // Last sector of multi-sector write
+    else
+      POKE(sd_ctl, 0x05); // All other sectors
+
+    // Wait for SD card to go busy
+    while (!(PEEK(sd_ctl) & 3))
+      continue;
+
+    // Wait for SD card to go ready
+    sdcard_wait_ready();
+
+    if (PEEK(sd_ctl) & 0x67)
+      break;
+
+    sdcard_stats.sectors_written++;
+    POKE(0xD020, sdcard_stats.sectors_written & 0x0f);
+  }
+
+  if (n == count)
+    return;
+
+  // Abandon the multi-sector write, and fall back to single sector writes
+  sdcard_stats.retries++;
+  POKE(sd_ctl, 0); // begin reset
+  usleep(500000);
+  POKE(sd_ctl, 1); // end reset
+  for (; n < count; n++) {
+    lcopy(buffer_address + ((long)n << 9), (long)sector_buffer, 512);
+    wcache_write_through(first_sector + n);
+  }
+}
+
+uint16_t sdcard_verifysectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  uint16_t n, j, bad = 0;
+
+  wcache_flush_range(first_sector, first_sector + count - 1);
+  trace_op(TRACE_VERIFY, first_sector, count);
+
+  for (n = 0; n < count; n++) {
+    do_read_sector(0x02, first_sector + n);
+    lcopy(buffer_address + ((long)n << 9), (long)verify_buffer, 512);
+    for (j = 0; j < 512; j++)
+      if (sector_buffer[j] != verify_buffer[j])
+        break;
+    if (j != 512) {
+      lcopy((long)verify_buffer, (long)sector_buffer, 512);
+      wcache_write_through(first_sector + n);
+      sdcard_stats.verify_failures++;
+      bad++;
+    }
+  }
+  return bad;
+}
+
+// CIA2 timers A and B, cascaded into a 32-bit down counter clocked at ~1MHz
+#define CIA2_TIMER_A 0xDD04U
+#define CIA2_TIMER_B 0xDD06U
+#define CIA2_CRA 0xDD0EU
+#define CIA2_CRB 0xDD0FU
+static unsigned char timer_running = 0;
+
+uint32_t timer_read_us(void)
+{
+  unsigned char b_hi, b_lo, a_hi, a_lo;
+
+  if (!timer_running) {
+    POKE(CIA2_TIMER_A + 0, 0xff);
+    POKE(CIA2_TIMER_A + 1, 0xff);
+    POKE(CIA2_TIMER_B + 0, 0xff);
+    POKE(CIA2_TIMER_B + 1, 0xff);
+    POKE(CIA2_CRB, 0x51); // load, start, count timer A underflows
+    POKE(CIA2_CRA, 0x11); // load, start, continuous
+    timer_running = 1;
+  }
+
+  // Re-read if a byte we already have changed while we were reading: timer A
+  // low byte wrapped (so A high ticked), or timer A wrapped (so B ticked)
+  do {
+    b_hi = PEEK(CIA2_TIMER_B + 1);
+    b_lo = PEEK(CIA2_TIMER_B + 0);
+    a_hi = PEEK(CIA2_TIMER_A + 1);
+    a_lo = PEEK(CIA2_TIMER_A + 0);
+  } while (a_hi != PEEK(CIA2_TIMER_A + 1) || b_lo != PEEK(CIA2_TIMER_B + 0) || b_hi != PEEK(CIA2_TIMER_B + 1));
+
+  return ~(((uint32_t)b_hi << 24) | ((uint32_t)b_lo << 16) | ((uint16_t)a_hi << 8) | a_lo);
 }
 
 static uint16_t i;
 
-void sdcard_readspeed_test(void)
+uint16_t sdcard_readspeed_test(void)
 {
+  // Returns the read speed of the selected card in KB/sec
   uint32_t n;
-  uint32_t total_time = 0;
-  uint8_t last_raster = 0;
-  uint16_t speed;
+  uint32_t msec;
 
+  msec = timer_read_us();
   n = 0;
   for (i = 0; i < 1000; i++) {
     POKE(sd_addr + 0, (n >> 0) & 0xff);
@@ -452,33 +697,18 @@ void sdcard_readspeed_test(void)
     POKE(sd_ctl, 0x02);
     while (!(PEEK(sd_ctl) & 3))
       continue;
-    while (PEEK(sd_ctl) & 3) {
-      if (PEEK(0xD012U) != last_raster) {
-        total_time++;
-        last_raster = PEEK(0xD012U);
-      }
-    }
+    while (PEEK(sd_ctl) & 3)
+      continue;
 
     POKE(0xD020U, PEEK(0xD020U) + 1);
   }
+  msec = (timer_read_us() - msec) / 1000;
 
-  // Bus interface makes for an upper limit of about 3MB/sec
-  // Divide total time by 1000 to get # rasters per sector.
-  // Then convert rasters to miliseconds.
-  // 60Hz 800x600 uses ~26 usec per raster.
-  // But our rasters are 2 physical rasters, so ~52 usec per line
-  // Round it to 50 usec for ease of calculation.
-  // A count of 1000 = 50 usec per sector = 10MB/sec
-  // A count of 20000 = 1 msec per sector = 512KB/sec
-  // If it takes 1 raster on average, then the speed is (1sec/50usec) sectors/sec
-  // = 20000 sectors / second = 10MB /sec.
-  // Thus we can call the speed 10000*1000 / rasters*1000
-  // = 10000000 / total_time
-
-  speed = 10000000L / total_time;
-
-  write_line("SD Card read speed =       KB/sec", 2);
-  screen_decimal(screen_line_address - 80 + 23, speed);
+  // Bus interface makes for an upper limit of about 3MB/sec.
+  // 1000 sectors = 512000 bytes, and KB/sec is the same as bytes/msec.
+  if (!msec)
+    msec = 1;
+  return 512000L / msec;
 }
 
 #if 0
@@ -565,7 +795,7 @@ void multisector_write_test(void)
 	verify_errors++;
 	break;
       }
-    if (i==512) POKE(SCREEN_ADDRESS+80+n-first_sector,0);
+    if (i==512) POKE(screen_top+80+n-first_sector,0);
   }
 
   // Set address of first sector
@@ -588,7 +818,7 @@ void multisector_write_test(void)
     sector_buffer[2]=n>>16;
     sector_buffer[3]=n>>24;
     lcopy((long)sector_buffer,sd_sectorbuffer,512);
-    POKE(SCREEN_ADDRESS+10*80+n-first_sector,lpeek(sd_sectorbuffer));
+    POKE(screen_top+10*80+n-first_sector,lpeek(sd_sectorbuffer));
     
     if (sector_number)
       POKE(sd_ctl,0x57); // open SD card write gate
@@ -631,12 +861,12 @@ void multisector_write_test(void)
 	  ||(sector_buffer[2]!=((n>>16)&0xff))
 	  ||(sector_buffer[3]!=((n>>24)&0xff)))
 	{
-	  POKE(SCREEN_ADDRESS+3*80+n-first_sector,0x2e);
-	  POKE(SCREEN_ADDRESS+4*80+n-first_sector,i&0xff);
+	  POKE(screen_top+3*80+n-first_sector,0x2e);
+	  POKE(screen_top+4*80+n-first_sector,i&0xff);
 	  verify_errors++;
 	}
       else {
-	POKE(SCREEN_ADDRESS+3*80+n-first_sector,2);
+	POKE(screen_top+3*80+n-first_sector,2);
       }
     }    
   } else POKE(0xD021U,0);
@@ -654,10 +884,17 @@ void multisector_write_test(void)
 void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
 {
   uint32_t n;
+
+  if (last_sector < first_sector)
+    return;
+
+  trace_op(TRACE_ERASE, first_sector, last_sector - first_sector + 1);
+  wcache_drop(first_sector, last_sector);
   lfill((uint32_t)sector_buffer, 0, 512);
   lcopy((long)sector_buffer, sd_sectorbuffer, 512);
 
   //  fprintf(stderr,"ERASING SECTORS %d..%d\r\n",first_sector,last_sector);
+  progress_begin("Erasing", last_sector - first_sector + 1);
 
 #ifndef NOFAST_ERASE
   POKE(sd_addr + 0, (first_sector >> 0) & 0xff);
@@ -670,8 +907,7 @@ void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
 
 #ifndef NOFAST_ERASE
     // Wait for SD card to go ready
-    while (PEEK(sd_ctl) & 3)
-      continue;
+    sdcard_wait_ready();
 
     if (n)
       POKE(sd_ctl, 0x57); // open SD card write gate
@@ -694,15 +930,36 @@ void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
       continue;
 
     // Wait for SD card to go ready
-    while (PEEK(sd_ctl) & 3)
-      continue;
+    sdcard_wait_ready();
+
+    if (PEEK(sd_ctl) & 0x67)
+      break;
 
 #else
-    sdcard_writesector(n);
+    wcache_write_through(n);
 #endif
 
-    // Show count-down
-    screen_decimal(screen_line_address + 1, last_sector - n);
+    progress_update(n - first_sector + 1);
     //    fprintf(stderr,"."); fflush(stderr);
   }
+
+  sdcard_stats.sectors_erased += n - first_sector;
+  if (n > first_sector)
+    known_note_erase(first_sector, n - 1);
+
+  if (n <= last_sector) {
+    // Only the sectors before n are known to be zero. Abandon the
+    // multi-sector write, and zero the rest one sector at a time, with the
+    // usual retries and verification.
+    sdcard_stats.retries++;
+    known_forget(n, last_sector);
+    POKE(sd_ctl, 0); // begin reset
+    usleep(500000);
+    POKE(sd_ctl, 1); // end reset
+    for (; n <= last_sector; n++) {
+      wcache_write_through(n);
+      progress_update(n - first_sector + 1);
+    }
+  }
+  progress_end();
 }
@@ -1,11 +1,53 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <string.h>
 #include <strings.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #include "fdisk_hal.h"
+#include "fdisk_known.h"
+#include "fdisk_trace.h"
+#include "fdisk_wcache.h"
+#include "fdisk_progress.h"
 
-FILE *sdcard = NULL;
+// Raw file descriptor of the SD card / image. All I/O is positional
+// (pread/pwrite), so there is no seek state and no stdio buffering.
+int sdcard_fd = -1;
+
+// Device or image file to format, and extra open(2) flags such as
+// O_DIRECT or O_SYNC (see --device and --io)
+char *sdcard_path = "/dev/sdb";
+int sdcard_open_flags = 0;
+
+// O_DIRECT needs aligned buffers, so unaligned transfers are bounced
+// through this buffer, BOUNCE_SECTORS at a time.
+#define BOUNCE_SECTORS 128
+#define BOUNCE_ALIGN 4096
+static uint8_t *bounce_buffer = NULL;
+
+// If non-zero, use this many bytes as the size of the SD card instead of
+// the size of the image file or block device (see --size)
+uint64_t sdcard_size_override = 0;
+
+struct sdcard_stats sdcard_stats;
+
+static double busy_since(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
 unsigned char sdcard_reset(void)
 {
@@ -17,14 +59,94 @@ void sdcard_select(unsigned char n)
   return;
 }
 
+void sdcard_forget_size(unsigned char n)
+{
+}
+
+/*
+  Transfer <len> bytes at byte offset <offset>, retrying short transfers
+  and EINTR. Reads past the end of an image file are zero-filled, so that
+  reading a not-yet-written sector behaves like reading a blank card.
+*/
+static void sdcard_pio(const int write, uint8_t *buffer, size_t len, off_t offset)
+{
+  struct timespec start;
+  ssize_t r;
+
+  if (bounce_buffer && ((uintptr_t)buffer & (BOUNCE_ALIGN - 1))) {
+    while (len) {
+      size_t chunk = len < BOUNCE_SECTORS * 512 ? len : BOUNCE_SECTORS * 512;
+      if (write)
+        memcpy(bounce_buffer, buffer, chunk);
+      sdcard_pio(write, bounce_buffer, chunk, offset);
+      if (!write)
+        memcpy(buffer, bounce_buffer, chunk);
+      buffer += chunk;
+      len -= chunk;
+      offset += chunk;
+    }
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (len) {
+    if (write)
+      r = pwrite(sdcard_fd, buffer, len, offset);
+    else
+      r = pread(sdcard_fd, buffer, len, offset);
+    if (r < 0) {
+      if (errno == EINTR) {
+        sdcard_stats.retries++;
+        continue;
+      }
+      fprintf(stderr, "Could not %s SD card at offset %lld.\n", write ? "write" : "read", (long long)offset);
+      perror(write ? "pwrite" : "pread");
+      exit(-1);
+    }
+    if (!r) {
+      if (write) {
+        fprintf(stderr, "Short write to SD card at offset %lld.\n", (long long)offset);
+        exit(-1);
+      }
+      bzero(buffer, len);
+      break;
+    }
+    buffer += r;
+    len -= r;
+    offset += r;
+    if (len)
+      sdcard_stats.retries++;
+  }
+  sdcard_stats.busy_us += busy_since(&start) * 1e6;
+}
+
 void sdcard_readsector(const uint32_t sector_number)
 {
-  fseek(sdcard, sector_number * 512LL, SEEK_SET);
-  fread(sector_buffer, 512, 1, sdcard);
+  trace_op(TRACE_READ, sector_number, 1);
+  if (wcache_read(sector_number))
+    return;
+  sdcard_pio(0, sector_buffer, 512, (off_t)sector_number * 512);
+  sdcard_stats.sectors_read++;
+}
+
+void sdcard_readsectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  wcache_flush_range(first_sector, first_sector + count - 1);
+  trace_op(TRACE_READ, first_sector, count);
+  sdcard_pio(0, (uint8_t *)buffer_address, (size_t)count * 512, (off_t)first_sector * 512);
+  sdcard_stats.sectors_read += count;
+}
+
+void flash_readsector(const uint32_t sector_number)
+{
+  trace_op(TRACE_FLASH, sector_number, 1);
+  // There is no core flash on the host
+  bzero(sector_buffer, 512);
 }
 
-void sdcard_readspeed_test(void)
+uint16_t sdcard_readspeed_test(void)
 {
+  return 0;
 }
 
 void mega65_fast(void)
@@ -35,56 +157,252 @@ void sdcard_map_sector_buffer(void)
 {
 }
 
+// 8MiB: 1MiB before the first partition, plus minimal system and FAT32 partitions
+#define SDCARD_MIN_SECTORS (8 * 2048L)
+
 uint32_t sdcard_getsize(void)
 {
   struct stat s;
+  uint64_t bytes = 0;
 
-  if (!sdcard) {
+  if (sdcard_fd < 0) {
     fprintf(stderr, "SD card not open.\n");
     exit(-1);
   }
 
-  int r = fstat(fileno(sdcard), &s);
+  int r = fstat(sdcard_fd, &s);
 
   if (r) {
     perror("stat");
     exit(-1);
   }
 
-  fprintf(stderr, "Size = $%08X sectors.\n", (unsigned int)(16000000000LL / 512LL));
-  //  return s.st_size/512;
-  return 16000000000LL / 512;
+  if (S_ISBLK(s.st_mode)) {
+#ifdef BLKGETSIZE64
+    if (ioctl(sdcard_fd, BLKGETSIZE64, &bytes)) {
+      perror("BLKGETSIZE64");
+      exit(-1);
+    }
+#else
+    bytes = lseek(sdcard_fd, 0, SEEK_END);
+#endif
+  }
+  else
+    bytes = s.st_size;
+
+  if (sdcard_size_override) {
+    if (S_ISREG(s.st_mode) && bytes < sdcard_size_override) {
+      // Grow (sparse) image files to the requested size
+      if (ftruncate(sdcard_fd, sdcard_size_override)) {
+        perror("ftruncate");
+        exit(-1);
+      }
+    }
+    else if (bytes < sdcard_size_override) {
+      fprintf(stderr, "Requested size of %llu bytes exceeds device size of %llu bytes.\n",
+          (unsigned long long)sdcard_size_override, (unsigned long long)bytes);
+      exit(-1);
+    }
+    bytes = sdcard_size_override;
+  }
+
+  // Sector numbers are 32 bits
+  if ((bytes / 512) > 0xffffffffULL)
+    bytes = 0xffffffffULL * 512;
+
+  // Smaller than this, and the partition maths in main() underflows
+  if ((bytes / 512) < SDCARD_MIN_SECTORS) {
+    fprintf(stderr, "SD card is too small (%llu bytes). Use --size to set the size of new image files.\n",
+        (unsigned long long)bytes);
+    exit(-1);
+  }
+
+  fprintf(stderr, "Size = $%08X sectors.\n", (unsigned int)(bytes / 512));
+  return bytes / 512;
 }
 
 void sdcard_open(void)
 {
-  sdcard = fopen("/dev/sdb", "r+");
-  if (!sdcard) {
-    fprintf(stderr, "Could not open sdcard.img.\n");
-    perror("fopen");
+  if (sdcard_fd >= 0)
+    close(sdcard_fd);
+  known_reset();
+
+  // Create missing image files when we have been told what size to make them
+  if (sdcard_size_override)
+    sdcard_fd = open(sdcard_path, O_RDWR | O_CREAT | sdcard_open_flags, 0644);
+  else
+    sdcard_fd = open(sdcard_path, O_RDWR | sdcard_open_flags);
+  if (sdcard_fd < 0) {
+    fprintf(stderr, "Could not open %s.\n", sdcard_path);
+    perror("open");
     exit(-1);
   }
-}
 
-uint32_t write_count = 0;
+  if ((sdcard_open_flags & O_DIRECT) && !bounce_buffer) {
+    if (posix_memalign((void **)&bounce_buffer, BOUNCE_ALIGN, BOUNCE_SECTORS * 512)) {
+      perror("posix_memalign");
+      exit(-1);
+    }
+  }
+}
 
 void sdcard_writesector(const uint32_t sector_number)
 {
-  const uint8_t *buffer = sector_buffer;
+  trace_op(TRACE_WRITE, sector_number, 1);
+  if (wcache_write(sector_number))
+    return;
+
+  if (known_check(sector_number) == KNOWN_SAME) {
+    known_writes_elided++;
+    return;
+  }
+
+  sdcard_pio(1, sector_buffer, 512, (off_t)sector_number * 512);
+  known_note_write(sector_number);
+
+  sdcard_stats.sectors_written++;
+}
+
+void sdcard_writesectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  trace_op(TRACE_WRITE, first_sector, count);
+  wcache_drop(first_sector, first_sector + count - 1);
+  sdcard_pio(1, (uint8_t *)buffer_address, (size_t)count * 512, (off_t)first_sector * 512);
+  known_forget(first_sector, first_sector + count - 1);
+
+  sdcard_stats.sectors_written += count;
+}
+
+uint16_t sdcard_verifysectors(const uint32_t first_sector, const long buffer_address, const uint16_t count)
+{
+  static uint8_t verify_buffer[512];
+  uint8_t *expected = (uint8_t *)buffer_address;
+  uint16_t n, bad = 0;
+
+  wcache_flush_range(first_sector, first_sector + count - 1);
+  trace_op(TRACE_VERIFY, first_sector, count);
+  for (n = 0; n < count; n++, expected += 512) {
+    sdcard_pio(0, verify_buffer, 512, (off_t)(first_sector + n) * 512);
+    sdcard_stats.sectors_read++;
+    if (memcmp(verify_buffer, expected, 512)) {
+      memcpy(sector_buffer, expected, 512);
+      sdcard_pio(1, sector_buffer, 512, (off_t)(first_sector + n) * 512);
+      sdcard_stats.sectors_written++;
+      sdcard_stats.verify_failures++;
+      bad++;
+    }
+  }
+  return bad;
+}
+
+uint32_t timer_read_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+  Erase strategies, tried in this order until one works:
+  block devices are zeroed (or discarded, if the device guarantees that
+  discarded blocks read back as zero) by the kernel, image files have the
+  range zeroed or hole-punched in the file system, and failing all that
+  we write zeroes in large chunks.
+*/
+#define ERASE_CHUNK_SECTORS 2048
+static uint8_t *erase_buffer = NULL;
+
+static const char *sdcard_erase_blockdev(off_t offset, off_t len)
+{
+#ifdef BLKZEROOUT
+  uint64_t range[2] = { offset, len };
+  int discard_zeroes = 0;
 
-  fseek(sdcard, sector_number * 512LL, SEEK_SET);
-  fwrite(buffer, 512, 1, sdcard);
+  if (!ioctl(sdcard_fd, BLKZEROOUT, range))
+    return "BLKZEROOUT";
+  if (!ioctl(sdcard_fd, BLKDISCARDZEROES, &discard_zeroes) && discard_zeroes) {
+    range[0] = offset;
+    range[1] = len;
+    if (!ioctl(sdcard_fd, BLKDISCARD, range))
+      return "BLKDISCARD";
+  }
+#endif
+  return NULL;
+}
 
-  write_count++;
+static const char *sdcard_erase_file(off_t offset, off_t len)
+{
+#ifdef FALLOC_FL_ZERO_RANGE
+  if (!fallocate(sdcard_fd, FALLOC_FL_ZERO_RANGE, offset, len))
+    return "FALLOC_FL_ZERO_RANGE";
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (!fallocate(sdcard_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len))
+    return "FALLOC_FL_PUNCH_HOLE";
+#endif
+  return NULL;
+}
+
+static const char *sdcard_erase_pwrite(off_t offset, off_t len)
+{
+  size_t chunk;
+  off_t done = 0;
+
+  if (!erase_buffer) {
+    // Aligned, so that it also works with O_DIRECT
+    if (posix_memalign((void **)&erase_buffer, BOUNCE_ALIGN, ERASE_CHUNK_SECTORS * 512)) {
+      perror("posix_memalign");
+      exit(-1);
+    }
+    bzero(erase_buffer, ERASE_CHUNK_SECTORS * 512);
+  }
+
+  progress_begin("Erasing", len / 512);
+  while (len) {
+    chunk = len < ERASE_CHUNK_SECTORS * 512 ? len : ERASE_CHUNK_SECTORS * 512;
+    sdcard_pio(1, erase_buffer, chunk, offset);
+    offset += chunk;
+    len -= chunk;
+    done += chunk;
+    progress_update(done / 512);
+  }
+  progress_end();
+  return "pwrite";
 }
 
 void sdcard_erase(const uint32_t first_sector, const uint32_t last_sector)
 {
-  uint32_t n;
+  struct stat s;
+  struct timespec start;
+  const char *strategy = NULL;
+  off_t offset = (off_t)first_sector * 512;
+  off_t len = ((off_t)last_sector - first_sector + 1) * 512;
+
   bzero(sector_buffer, 512);
 
-  fprintf(stderr, "Erasing sectors %d..%d\n", first_sector, last_sector);
+  if (last_sector < first_sector)
+    return;
+
+  trace_op(TRACE_ERASE, first_sector, last_sector - first_sector + 1);
+  wcache_drop(first_sector, last_sector);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!fstat(sdcard_fd, &s)) {
+    if (S_ISBLK(s.st_mode))
+      strategy = sdcard_erase_blockdev(offset, len);
+    else if (S_ISREG(s.st_mode))
+      strategy = sdcard_erase_file(offset, len);
+  }
+  if (!strategy)
+    strategy = sdcard_erase_pwrite(offset, len);
+  known_note_erase(first_sector, last_sector);
+
+  sdcard_stats.sectors_erased += last_sector - first_sector + 1;
+  if (strcmp(strategy, "pwrite"))
+    // sdcard_pio() has already accounted for the pwrite() fallback
+    sdcard_stats.busy_us += busy_since(&start) * 1e6;
 
-  for (n = first_sector; n <= last_sector; n++)
-    sdcard_writesector(n);
+  fprintf(stderr, "Erased sectors %u..%u (%llu KiB) using %s in %.3f sec\n", first_sector, last_sector,
+      (unsigned long long)len / 1024, strategy, busy_since(&start));
 }
@@ -0,0 +1,156 @@
+/*
+  Known sector contents tracker.
+
+  We remember two things:
+  1. Ranges of sectors that sdcard_erase() has zeroed, and that have not
+     been written with anything else since.
+  2. A short hash of the last contents written to recently written sectors.
+
+  Only two verdicts are ever certain: a sector in a zero range compared with
+  sector_buffer, and a hash mismatch (which proves the contents differ).
+  A hash match is NOT proof of identical contents, so it is reported as
+  KNOWN_UNKNOWN, and the caller has to compare for real.
+
+  Dropping knowledge is always safe, so when a table is full we simply
+  forget something.
+*/
+
+#include "fdisk_hal.h"
+#include "fdisk_known.h"
+
+#define KNOWN_ZERO_RANGES 8
+#define KNOWN_HASH_SLOTS 32
+
+uint32_t known_zero_first[KNOWN_ZERO_RANGES];
+uint32_t known_zero_last[KNOWN_ZERO_RANGES];
+unsigned char known_zero_count = 0;
+
+uint32_t known_hash_sector[KNOWN_HASH_SLOTS];
+uint16_t known_hash_value[KNOWN_HASH_SLOTS];
+unsigned char known_hash_valid[KNOWN_HASH_SLOTS];
+
+uint32_t known_reads_saved = 0;
+uint32_t known_writes_elided = 0;
+
+// Result of the last scan of sector_buffer by known_check()
+static uint16_t known_buffer_hash;
+static unsigned char known_buffer_zero;
+
+static unsigned char ki;
+
+void known_reset(void)
+{
+  known_zero_count = 0;
+  for (ki = 0; ki < KNOWN_HASH_SLOTS; ki++)
+    known_hash_valid[ki] = 0;
+}
+
+static void known_scan(void)
+{
+  // Fletcher style checksum, cheap enough for a 6502
+  uint16_t i;
+  uint8_t a = 0, b = 0, nz = 0;
+
+  for (i = 0; i < 512; i++) {
+    a += sector_buffer[i];
+    b += a;
+    nz |= sector_buffer[i];
+  }
+  known_buffer_hash = (b << 8) | a;
+  known_buffer_zero = !nz;
+}
+
+static void known_drop_range(unsigned char r)
+{
+  known_zero_count--;
+  known_zero_first[r] = known_zero_first[known_zero_count];
+  known_zero_last[r] = known_zero_last[known_zero_count];
+}
+
+static void known_clip(const uint32_t first_sector, const uint32_t last_sector)
+{
+  // Remove first_sector..last_sector from all zero ranges
+  for (ki = 0; ki < known_zero_count; ki++) {
+    if (last_sector < known_zero_first[ki] || first_sector > known_zero_last[ki])
+      continue;
+    if (first_sector <= known_zero_first[ki] && last_sector >= known_zero_last[ki]) {
+      known_drop_range(ki);
+      // Look at the range that was moved into this slot next
+      ki--;
+    }
+    else if (first_sector <= known_zero_first[ki])
+      known_zero_first[ki] = last_sector + 1;
+    else if (last_sector >= known_zero_last[ki])
+      known_zero_last[ki] = first_sector - 1;
+    else if (known_zero_count < KNOWN_ZERO_RANGES) {
+      // Split in two
+      known_zero_first[known_zero_count] = last_sector + 1;
+      known_zero_last[known_zero_count] = known_zero_last[ki];
+      known_zero_count++;
+      known_zero_last[ki] = first_sector - 1;
+    }
+    else
+      // No room to split, so keep only the part before the hole
+      known_zero_last[ki] = first_sector - 1;
+  }
+}
+
+void known_forget(const uint32_t first_sector, const uint32_t last_sector)
+{
+  // Contents of these sectors have changed in a way we did not see
+  known_clip(first_sector, last_sector);
+  for (ki = 0; ki < KNOWN_HASH_SLOTS; ki++)
+    if (known_hash_valid[ki] && known_hash_sector[ki] >= first_sector && known_hash_sector[ki] <= last_sector)
+      known_hash_valid[ki] = 0;
+}
+
+void known_note_erase(const uint32_t first_sector, const uint32_t last_sector)
+{
+  unsigned char r, smallest = 0;
+
+  if (last_sector < first_sector)
+    return;
+
+  known_forget(first_sector, last_sector);
+
+  if (known_zero_count == KNOWN_ZERO_RANGES) {
+    // Table full: replace the smallest range, if the new one is bigger
+    for (r = 1; r < KNOWN_ZERO_RANGES; r++)
+      if (known_zero_last[r] - known_zero_first[r] < known_zero_last[smallest] - known_zero_first[smallest])
+        smallest = r;
+    if (known_zero_last[smallest] - known_zero_first[smallest] >= last_sector - first_sector)
+      return;
+    known_drop_range(smallest);
+  }
+  known_zero_first[known_zero_count] = first_sector;
+  known_zero_last[known_zero_count] = last_sector;
+  known_zero_count++;
+}
+
+unsigned char known_check(const uint32_t sector_number)
+{
+  known_scan();
+
+  for (ki = 0; ki < known_zero_count; ki++) {
+    if (sector_number >= known_zero_first[ki] && sector_number <= known_zero_last[ki])
+      return known_buffer_zero ? KNOWN_SAME : KNOWN_DIFFERENT;
+  }
+
+  ki = sector_number & (KNOWN_HASH_SLOTS - 1);
+  if (known_hash_valid[ki] && known_hash_sector[ki] == sector_number && known_hash_value[ki] != known_buffer_hash)
+    return KNOWN_DIFFERENT;
+
+  return KNOWN_UNKNOWN;
+}
+
+void known_note_write(const uint32_t sector_number)
+{
+  // sector_number now holds sector_buffer, as last scanned by known_check()
+  if (!known_buffer_zero)
+    known_clip(sector_number, sector_number);
+
+  ki = sector_number & (KNOWN_HASH_SLOTS - 1);
+  known_hash_sector[ki] = sector_number;
+  known_hash_value[ki] = known_buffer_hash;
+  known_hash_valid[ki] = 1;
+}
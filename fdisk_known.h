@@ -0,0 +1,18 @@
+/*
+  Tracker for sector contents that are already known, so that the HALs can
+  skip the read-before-write comparison (MEGA65) or the write itself (UNIX)
+  when the outcome is certain.
+*/
+
+#define KNOWN_UNKNOWN 0
+#define KNOWN_SAME 1      // Sector already holds the contents of sector_buffer
+#define KNOWN_DIFFERENT 2 // Sector definitely differs from sector_buffer
+
+void known_reset(void);
+void known_note_erase(const uint32_t first_sector, const uint32_t last_sector);
+void known_forget(const uint32_t first_sector, const uint32_t last_sector);
+unsigned char known_check(const uint32_t sector_number);
+void known_note_write(const uint32_t sector_number);
+
+extern uint32_t known_reads_saved;
+extern uint32_t known_writes_elided;
@@ -28,120 +28,135 @@ struct dmagic_dmalist {
   unsigned int modulo;
 };
 
-struct dmagic_dmalist dmalist;
 unsigned char dma_byte;
+unsigned long dma_jobs = 0;
 
 #ifdef __CC65__
-void do_dma(void)
+// Each kind of job has its own list, with the fields that never change
+// filled in once here, so that only the addresses and count are set per call.
+#define DMA_OPTIONS 0x0b, 0x80, 0x00, 0x81, 0x00, 0x00
+
+struct dmagic_dmalist peek_list = { DMA_OPTIONS, 0x00, 1, 0, 0, (unsigned int)&dma_byte, 0, 0, 0 };
+struct dmagic_dmalist poke_list = { DMA_OPTIONS, 0x00, 1, (unsigned int)&dma_byte, 0, 0, 0, 0, 0 };
+struct dmagic_dmalist copy_list = { DMA_OPTIONS, 0x00, 0, 0, 0, 0, 0, 0, 0 };
+struct dmagic_dmalist fill_list = { DMA_OPTIONS, 0x03, 0, 0, 0, 0, 0, 0, 0 };
+
+// Chained jobs follow each other in memory, each with its own options
+struct dmagic_dmalist chain_list[DMA_CHAIN_JOBS];
+unsigned char chain_jobs = 0;
+
+void do_dma(struct dmagic_dmalist *list)
 {
-  unsigned char i;
   m65_io_enable();
-
-  //  for(i=0;i<24;i++)
-  // screen_hex_byte(SCREEN_ADDRESS+i*3,PEEK(i+(unsigned int)&dmalist));
+  dma_jobs++;
 
   // Now run DMA job (to and from anywhere, and list is in low 1MB)
   POKE(0xd702U, 0);
   POKE(0xd704U, 0x00); // List is in $00xxxxx
-  POKE(0xd701U, ((unsigned int)&dmalist) >> 8);
-  POKE(0xd705U, ((unsigned int)&dmalist) & 0xff); // triggers enhanced DMA
+  POKE(0xd701U, ((unsigned int)list) >> 8);
+  POKE(0xd705U, ((unsigned int)list) & 0xff); // triggers enhanced DMA
+}
+
+static void set_copy(struct dmagic_dmalist *job, long source_address, long destination_address, unsigned int count)
+{
+  job->source_mb = source_address >> 20;
+  job->dest_mb = destination_address >> 20;
+  job->count = count;
+  job->source_addr = source_address & 0xffff;
+  job->source_bank = (source_address >> 16) & 0x0f;
+  if (source_address >= 0xd000 && source_address < 0xe000)
+    job->source_bank |= 0x80;
+  job->dest_addr = destination_address & 0xffff;
+  job->dest_bank = (destination_address >> 16) & 0x0f;
+  if (destination_address >= 0xd000 && destination_address < 0xe000)
+    job->dest_bank |= 0x80;
+}
+
+static void set_fill(struct dmagic_dmalist *job, long destination_address, unsigned char value, unsigned int count)
+{
+  job->dest_mb = destination_address >> 20;
+  job->count = count;
+  job->source_addr = value;
+  job->dest_addr = destination_address & 0xffff;
+  job->dest_bank = (destination_address >> 16) & 0x0f;
+  if (destination_address >= 0xd000 && destination_address < 0xe000)
+    job->dest_bank |= 0x80;
 }
 
 unsigned char lpeek(long address)
 {
   // Read the byte at <address> in 28-bit address space
-  // XXX - Optimise out repeated setup etc
-  // (separate DMA lists for peek, poke and copy should
-  // save space, since most fields can stay initialised).
-
-  dmalist.option_0b = 0x0b;
-  dmalist.option_80 = 0x80;
-  dmalist.source_mb = (address >> 20);
-  dmalist.option_81 = 0x81;
-  dmalist.dest_mb = 0x00; // dma_byte lives in 1st MB
-  dmalist.end_of_options = 0x00;
-
-  dmalist.command = 0x00; // copy
-  dmalist.count = 1;
-  dmalist.source_addr = address & 0xffff;
-  dmalist.source_bank = (address >> 16) & 0x7f;
-  dmalist.dest_addr = (unsigned int)&dma_byte;
-  dmalist.dest_bank = 0;
-
-  do_dma();
+  peek_list.source_mb = (address >> 20);
+  peek_list.source_addr = address & 0xffff;
+  peek_list.source_bank = (address >> 16) & 0x0f;
+
+  do_dma(&peek_list);
 
   return dma_byte;
 }
 
 void lpoke(long address, unsigned char value)
 {
-
-  dmalist.option_0b = 0x0b;
-  dmalist.option_80 = 0x80;
-  dmalist.source_mb = 0x00; // dma_byte lives in 1st MB
-  dmalist.option_81 = 0x81;
-  dmalist.dest_mb = (address >> 20);
-  dmalist.end_of_options = 0x00;
-
   dma_byte = value;
-  dmalist.command = 0x00; // copy
-  dmalist.count = 1;
-  dmalist.source_addr = (unsigned int)&dma_byte;
-  dmalist.source_bank = 0;
-  dmalist.dest_addr = address & 0xffff;
-  dmalist.dest_bank = (address >> 16) & 0x7f;
-
-  do_dma();
+  poke_list.dest_mb = (address >> 20);
+  poke_list.dest_addr = address & 0xffff;
+  poke_list.dest_bank = (address >> 16) & 0x0f;
+
+  do_dma(&poke_list);
   return;
 }
 
 void lcopy(long source_address, long destination_address, unsigned int count)
 {
-  dmalist.option_0b = 0x0b;
-  dmalist.option_80 = 0x80;
-  dmalist.source_mb = source_address >> 20;
-  dmalist.option_81 = 0x81;
-  dmalist.dest_mb = (destination_address >> 20);
-  dmalist.end_of_options = 0x00;
-
-  dmalist.command = 0x00; // copy
-  dmalist.count = count;
-  dmalist.sub_cmd = 0;
-  dmalist.source_addr = source_address & 0xffff;
-  dmalist.source_bank = (source_address >> 16) & 0x0f;
-  if (source_address >= 0xd000 && source_address < 0xe000)
-    dmalist.source_bank |= 0x80;
-  dmalist.dest_addr = destination_address & 0xffff;
-  dmalist.dest_bank = (destination_address >> 16) & 0x0f;
-  if (destination_address >= 0xd000 && destination_address < 0xe000)
-    dmalist.dest_bank |= 0x80;
-
-  do_dma();
+  set_copy(&copy_list, source_address, destination_address, count);
+  do_dma(&copy_list);
   return;
 }
 
 void lfill(long destination_address, unsigned char value, unsigned int count)
 {
-  dmalist.option_0b = 0x0b;
-  dmalist.option_80 = 0x80;
-  dmalist.source_mb = 0x00;
-  dmalist.option_81 = 0x81;
-  dmalist.dest_mb = destination_address >> 20;
-  dmalist.end_of_options = 0x00;
-
-  dmalist.command = 0x03; // fill
-  dmalist.sub_cmd = 0;
-  dmalist.count = count;
-  dmalist.source_addr = value;
-  dmalist.dest_addr = destination_address & 0xffff;
-  dmalist.dest_bank = (destination_address >> 16) & 0x7f;
-  if (destination_address >= 0xd000 && destination_address < 0xe000)
-    dmalist.dest_bank |= 0x80;
-
-  do_dma();
+  set_fill(&fill_list, destination_address, value, count);
+  do_dma(&fill_list);
   return;
 }
 
+static struct dmagic_dmalist *dma_chain_add(unsigned char command)
+{
+  struct dmagic_dmalist *job;
+
+  if (chain_jobs == DMA_CHAIN_JOBS)
+    dma_chain_submit();
+  job = &chain_list[chain_jobs++];
+  job->option_0b = 0x0b;
+  job->option_80 = 0x80;
+  job->source_mb = 0x00;
+  job->option_81 = 0x81;
+  job->end_of_options = 0x00;
+  job->command = command | 0x04; // chain to the next job, until submitted
+  job->sub_cmd = 0;
+  job->modulo = 0;
+  return job;
+}
+
+void dma_chain_copy(long source_address, long destination_address, unsigned int count)
+{
+  set_copy(dma_chain_add(0x00), source_address, destination_address, count);
+}
+
+void dma_chain_fill(long destination_address, unsigned char value, unsigned int count)
+{
+  set_fill(dma_chain_add(0x03), destination_address, value, count);
+}
+
+void dma_chain_submit(void)
+{
+  if (!chain_jobs)
+    return;
+  chain_list[chain_jobs - 1].command &= ~0x04;
+  chain_jobs = 0;
+  do_dma(chain_list);
+}
+
 void m65_io_enable(void)
 {
   // Gate C65 IO enable
@@ -151,6 +166,92 @@ void m65_io_enable(void)
   POKE(0, 65);
 }
 #else
+#include <string.h>
+
+/*
+  On the host there is no 28-bit address space: addresses passed to
+  lcopy() and lfill() are plain pointers cast to long, and the
+  MEGA65 IO / screen addresses that lpeek() and lpoke() are used with
+  do not exist, so those read as zero and ignore writes.
+*/
+unsigned char fat_chain_buffer[FAT_CHAIN_SECTORS * 512];
+unsigned char populate_buffer[POPULATE_SECTORS * 512];
+unsigned char wcache_buffer[(WCACHE_SECTORS + 1) * 512];
+unsigned char fat_cache_buffer[FAT_CACHE_SECTORS * 512];
+
+unsigned char lpeek(long address)
+{
+  return 0;
+}
+
+void lpoke(long address, unsigned char value)
+{
+}
+
+void lcopy(long source_address, long destination_address, unsigned int count)
+{
+  dma_jobs++;
+  memmove((void *)destination_address, (void *)source_address, count);
+}
+
+void lfill(long destination_address, unsigned char value, unsigned int count)
+{
+  dma_jobs++;
+  memset((void *)destination_address, value, count);
+}
+
+// Queued jobs run in order when submitted, like a chained DMA list
+struct chain_job {
+  unsigned char fill;
+  unsigned char value;
+  unsigned int count;
+  long source_address;
+  long destination_address;
+};
+struct chain_job chain_list[DMA_CHAIN_JOBS];
+unsigned char chain_jobs = 0;
+
+static struct chain_job *dma_chain_add(void)
+{
+  if (chain_jobs == DMA_CHAIN_JOBS)
+    dma_chain_submit();
+  return &chain_list[chain_jobs++];
+}
+
+void dma_chain_copy(long source_address, long destination_address, unsigned int count)
+{
+  struct chain_job *job = dma_chain_add();
+  job->fill = 0;
+  job->count = count;
+  job->source_address = source_address;
+  job->destination_address = destination_address;
+}
+
+void dma_chain_fill(long destination_address, unsigned char value, unsigned int count)
+{
+  struct chain_job *job = dma_chain_add();
+  job->fill = 1;
+  job->value = value;
+  job->count = count;
+  job->destination_address = destination_address;
+}
+
+void dma_chain_submit(void)
+{
+  unsigned char i;
+
+  if (!chain_jobs)
+    return;
+  dma_jobs++;
+  for (i = 0; i < chain_jobs; i++) {
+    if (chain_list[i].fill)
+      memset((void *)chain_list[i].destination_address, chain_list[i].value, chain_list[i].count);
+    else
+      memmove((void *)chain_list[i].destination_address, (void *)chain_list[i].source_address, chain_list[i].count);
+  }
+  chain_jobs = 0;
+}
+
 void m65_io_enable(void)
 {
 }
@@ -4,10 +4,44 @@ unsigned char lpeek(long address);
 void lpoke(long address, unsigned char value);
 void lcopy(long source_address, long destination_address, unsigned int count);
 void lfill(long destination_address, unsigned char value, unsigned int count);
+// Chained DMA: up to DMA_CHAIN_JOBS copy and fill jobs are queued, and then
+// run in order as one DMA list by dma_chain_submit(). Queueing more submits
+// the ones before.
+#define DMA_CHAIN_JOBS 16
+void dma_chain_copy(long source_address, long destination_address, unsigned int count);
+void dma_chain_fill(long destination_address, unsigned char value, unsigned int count);
+void dma_chain_submit(void);
+// Number of DMA lists run (single jobs and submitted chains)
+extern unsigned long dma_jobs;
 #ifdef __CC65__
 #define POKE(X, Y) (*(unsigned char *)(X)) = Y
 #define PEEK(X) (*(unsigned char *)(X))
 #else
 #define POKE(X, Y)
-#define PEEK(X)
+#define PEEK(X) 0
+#endif
+
+// Staging buffers for multi-sector transfers. On the MEGA65 these live in
+// chip RAM banks 4 and 5, which nothing else uses. On the host they are
+// ordinary static arrays.
+// The write cache (fdisk_wcache.c) keeps its sectors, plus a spare, after them,
+// followed by the FAT32 module's read cache for FAT and directory sectors.
+#define FAT_CHAIN_SECTORS 16
+#define POPULATE_SECTORS 32
+#define WCACHE_SECTORS 16
+#define FAT_CACHE_SECTORS 16
+#ifdef __CC65__
+#define FAT_CHAIN_BUFFER 0x40000L
+#define POPULATE_BUFFER 0x42000L
+#define WCACHE_BUFFER 0x46000L
+#define FAT_CACHE_BUFFER 0x48200L
+#else
+extern unsigned char fat_chain_buffer[FAT_CHAIN_SECTORS * 512];
+extern unsigned char populate_buffer[POPULATE_SECTORS * 512];
+extern unsigned char wcache_buffer[(WCACHE_SECTORS + 1) * 512];
+extern unsigned char fat_cache_buffer[FAT_CACHE_SECTORS * 512];
+#define FAT_CHAIN_BUFFER ((long)fat_chain_buffer)
+#define POPULATE_BUFFER ((long)populate_buffer)
+#define WCACHE_BUFFER ((long)wcache_buffer)
+#define FAT_CACHE_BUFFER ((long)fat_cache_buffer)
 #endif
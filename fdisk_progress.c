@@ -0,0 +1,120 @@
+#include "fdisk_hal.h"
+#include "fdisk_memory.h"
+#include "fdisk_screen.h"
+#include "fdisk_progress.h"
+
+#ifndef __CC65__
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+char *progress_label;
+uint32_t progress_total;
+uint32_t progress_start_us;
+uint32_t progress_drawn_us;
+unsigned char progress_enabled = 0;
+unsigned char progress_shown = 0;
+
+#ifdef __CC65__
+// The line is put together here, and copied to the screen in one go.
+// screen_decimal() pads to 5 columns, so leave room for that at the end.
+unsigned char progress_line[80 + 5];
+static unsigned char pos;
+
+static void progress_text(char *s)
+{
+  while (*s && pos < 80)
+    progress_line[pos++] = *s++;
+}
+
+static void progress_number(const uint32_t value)
+{
+  if (pos < 70)
+    pos += screen_decimal((unsigned int)&progress_line[pos], value);
+}
+#endif
+
+static void progress_draw(const uint32_t done)
+{
+  uint32_t ms = (progress_drawn_us - progress_start_us) / 1000;
+  uint32_t kbytes = done >> 1;
+  uint32_t kb_per_sec, seconds_left;
+  unsigned char percent;
+
+  // Keep the intermediate values within 32 bits
+  if (!ms)
+    kb_per_sec = 0;
+  else if (kbytes < 4000000UL)
+    kb_per_sec = kbytes * 1000 / ms;
+  else
+    kb_per_sec = ms < 1000 ? kbytes : kbytes / (ms / 1000);
+  if (done >= progress_total)
+    percent = 100;
+  else if (progress_total > 0xffffffUL)
+    percent = done / (progress_total / 100);
+  else
+    percent = done * 100 / progress_total;
+  seconds_left = kb_per_sec && done < progress_total ? ((progress_total - done) >> 1) / kb_per_sec : 0;
+
+#ifdef __CC65__
+  lfill((long)progress_line, ' ', 80);
+  pos = 1;
+  progress_text(progress_label);
+  progress_text(" ");
+  progress_number(percent);
+  progress_text("% at ");
+  progress_number(kb_per_sec);
+  progress_text(" KB/sec, ");
+  progress_number(seconds_left);
+  progress_text(" sec to go");
+  lcopy((long)progress_line, screen_line_address, 80);
+#else
+  fprintf(stderr, "\r%-12s [%-30.*s] %3u%% at %6u KB/sec, %u sec to go  ", progress_label, percent * 30 / 100,
+      "##############################", percent, kb_per_sec, seconds_left);
+  fflush(stderr);
+#endif
+}
+
+void progress_begin(char *label, const uint32_t total_sectors)
+{
+  progress_label = label;
+  progress_total = total_sectors;
+  progress_start_us = timer_read_us();
+  progress_drawn_us = progress_start_us;
+  progress_shown = 0;
+#ifdef __CC65__
+  progress_enabled = 1;
+#else
+  // A bar redrawn with carriage returns only makes sense on a terminal
+  progress_enabled = isatty(fileno(stderr));
+#endif
+}
+
+void progress_update(const uint32_t done_sectors)
+{
+  uint32_t now;
+
+  if (!progress_enabled)
+    return;
+  now = timer_read_us();
+  if (now - progress_drawn_us < PROGRESS_INTERVAL_US)
+    return;
+  progress_drawn_us = now;
+  progress_shown = 1;
+  progress_draw(done_sectors);
+}
+
+void progress_end(void)
+{
+  // Short jobs never showed anything, so there is nothing to tidy up
+  if (!progress_shown)
+    return;
+#ifdef __CC65__
+  lfill(screen_line_address, ' ', 80);
+#else
+  progress_drawn_us = timer_read_us();
+  progress_draw(progress_total);
+  fputc('\n', stderr);
+#endif
+  progress_shown = 0;
+}
@@ -0,0 +1,21 @@
+/*
+  Progress of long loops (erasing, copying files, scanning the FAT), shown
+  with the percentage done, the rate and the time left.
+
+  Call progress_begin() with the total number of sectors, progress_update()
+  with the number done so far as often as is convenient, and progress_end()
+  when done. Updates are only drawn every PROGRESS_INTERVAL_US, so that the
+  drawing does not slow the loop down: once a frame on the MEGA65, on the
+  line below the cursor, and as a bar on stderr on the host, if that is a
+  terminal.
+*/
+
+#ifdef __CC65__
+#define PROGRESS_INTERVAL_US 20000UL
+#else
+#define PROGRESS_INTERVAL_US 100000UL
+#endif
+
+void progress_begin(char *label, const uint32_t total_sectors);
+void progress_update(const uint32_t done_sectors);
+void progress_end(void);
@@ -0,0 +1,264 @@
+/*
+  Replays a sector I/O trace (see fdisk_trace.h) against an image file with
+  the UNIX HAL, and reports on the access pattern of the trace.
+
+  usage: m65fdisk-replay [-n] trace [image]
+
+  The report gives the number of operations and sectors of each type, and
+  looks for:
+  - sectors written more than once,
+  - sectors read again after they were already read or written (i.e.,
+    reads that a cache could have saved),
+  - operations that start before the end of the previous one, i.e., that
+    seek backwards.
+
+  Unless -n is given, the trace is then replayed against the image, which
+  defaults to /dev/shm/m65fdisk-replay.img and is created or extended as
+  needed, and the time taken is compared with the time recorded in the
+  trace. Traces do not record sector contents, so a pattern is written
+  instead. Flash reads have no host equivalent, and are skipped. So are
+  write cache runs, as the writes they are made of are replayed one by one,
+  without the cache.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_trace.h"
+
+#define REPLAY_RUN 128
+
+uint8_t sector_buffer[512];
+uint8_t run_buffer[REPLAY_RUN * 512];
+
+struct trace_record *trace;
+uint32_t trace_count;
+
+// Open addressing hash set of sector numbers
+struct sector_set {
+  uint32_t *sectors;
+  uint8_t *used;
+  size_t size, count;
+};
+
+struct sector_set written, seen;
+
+int set_add(struct sector_set *set, const uint32_t sector);
+
+void set_grow(struct sector_set *set)
+{
+  struct sector_set old = *set;
+  size_t i;
+
+  set->size = old.size ? old.size * 2 : 4096;
+  set->count = 0;
+  set->sectors = calloc(set->size, sizeof(uint32_t));
+  set->used = calloc(set->size, 1);
+  if (!set->sectors || !set->used) {
+    perror("calloc");
+    exit(-1);
+  }
+  for (i = 0; i < old.size; i++)
+    if (old.used[i])
+      set_add(set, old.sectors[i]);
+  free(old.sectors);
+  free(old.used);
+}
+
+int set_add(struct sector_set *set, const uint32_t sector)
+{
+  // Returns 1 if <sector> was already in the set
+  size_t i;
+
+  if ((set->count + 1) * 2 > set->size)
+    set_grow(set);
+  for (i = (sector * 2654435761U) & (set->size - 1); set->used[i]; i = (i + 1) & (set->size - 1))
+    if (set->sectors[i] == sector)
+      return 1;
+  set->used[i] = 1;
+  set->sectors[i] = sector;
+  set->count++;
+  return 0;
+}
+
+void load_trace(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  char header[16];
+
+  if (!f) {
+    perror(path);
+    exit(-1);
+  }
+  if (fread(header, 16, 1, f) != 1 || memcmp(header, TRACE_MAGIC, 8)) {
+    fprintf(stderr, "%s is not a trace file.\n", path);
+    exit(-1);
+  }
+  memcpy(&trace_count, &header[8], 4);
+  trace = malloc((size_t)trace_count * sizeof(struct trace_record) + 1);
+  if (!trace) {
+    perror("malloc");
+    exit(-1);
+  }
+  if (fread(trace, sizeof(struct trace_record), trace_count, f) != trace_count) {
+    fprintf(stderr, "%s is truncated.\n", path);
+    exit(-1);
+  }
+  fclose(f);
+}
+
+int op_index(const uint8_t op)
+{
+  switch (op) {
+  case TRACE_READ:
+    return 0;
+  case TRACE_WRITE:
+    return 1;
+  case TRACE_ERASE:
+    return 2;
+  case TRACE_VERIFY:
+    return 3;
+  case TRACE_FLASH:
+    return 4;
+  case TRACE_FLUSH:
+    return 5;
+  }
+  fprintf(stderr, "Unknown trace operation $%02x.\n", op);
+  exit(-1);
+}
+
+const char *op_names[6] = { "read", "write", "erase", "verify", "flash read", "cache run" };
+uint32_t op_count[6];
+uint64_t op_sectors[6];
+uint32_t op_us[6];
+
+uint32_t analyse(void)
+{
+  // Returns the sector after the highest sector in the trace
+  uint32_t i, n, end = 0, prev_end = 0;
+  uint32_t rewrites = 0, rereads = 0, backwards = 0;
+  uint64_t seek_sectors = 0;
+  struct trace_record *r;
+
+  for (i = 0, r = trace; i < trace_count; i++, r++) {
+    int op = op_index(r->op);
+
+    op_count[op]++;
+    op_sectors[op] += r->count;
+    // Cache runs repeat writes that are in the trace already
+    if (r->op == TRACE_FLASH || r->op == TRACE_FLUSH)
+      continue;
+
+    if (r->sector < prev_end)
+      backwards++;
+    seek_sectors += r->sector > prev_end ? r->sector - prev_end : prev_end - r->sector;
+    prev_end = r->sector + r->count;
+    if (prev_end > end)
+      end = prev_end;
+
+    if (r->op == TRACE_ERASE)
+      continue;
+    for (n = r->sector; n < r->sector + r->count; n++) {
+      if (r->op == TRACE_WRITE) {
+        rewrites += set_add(&written, n);
+        set_add(&seen, n);
+      }
+      else
+        rereads += set_add(&seen, n);
+    }
+  }
+
+  printf("%u operations over %.3f sec:\n", trace_count, trace_count ? trace[trace_count - 1].time_us / 1e6 : 0.0);
+  for (i = 0; i < 6; i++)
+    if (op_count[i])
+      printf("  %-10s %8u ops %10llu sectors\n", op_names[i], op_count[i], (unsigned long long)op_sectors[i]);
+  printf("  %u sectors written more than once\n", rewrites);
+  printf("  %u sectors read after already being read or written\n", rereads);
+  printf("  %u operations seek backwards, %llu sectors of seeking in total\n", backwards,
+      (unsigned long long)seek_sectors);
+
+  return end;
+}
+
+void replay(void)
+{
+  uint32_t i, n, count, start, total = 0;
+  struct trace_record *r;
+
+  for (i = 0, r = trace; i < trace_count; i++, r++) {
+    start = timer_read_us();
+    switch (r->op) {
+    case TRACE_READ:
+    case TRACE_VERIFY:
+      for (n = 0; n < r->count; n += count) {
+        count = r->count - n < REPLAY_RUN ? r->count - n : REPLAY_RUN;
+        sdcard_readsectors(r->sector + n, (long)run_buffer, count);
+      }
+      break;
+    case TRACE_WRITE:
+      // Different contents for each write, so that none can be skipped
+      if (r->count == 1) {
+        memset(sector_buffer, i | 1, 512);
+        sdcard_writesector(r->sector);
+        break;
+      }
+      memset(run_buffer, i | 1, sizeof(run_buffer));
+      for (n = 0; n < r->count; n += count) {
+        count = r->count - n < REPLAY_RUN ? r->count - n : REPLAY_RUN;
+        sdcard_writesectors(r->sector + n, (long)run_buffer, count);
+      }
+      break;
+    case TRACE_ERASE:
+      sdcard_erase(r->sector, r->sector + r->count - 1);
+      break;
+    }
+    op_us[op_index(r->op)] += timer_read_us() - start;
+  }
+
+  printf("Replayed on %s:\n", sdcard_path);
+  for (i = 0; i < 6; i++)
+    if (op_count[i]) {
+      printf("  %-10s %10.3f sec\n", op_names[i], op_us[i] / 1e6);
+      total += op_us[i];
+    }
+  printf("  %u operations in %.3f sec, against %.3f sec in the trace\n", trace_count, total / 1e6,
+      trace_count ? trace[trace_count - 1].time_us / 1e6 : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+  int opt, analyse_only = 0;
+  uint32_t end;
+
+  while ((opt = getopt(argc, argv, "n")) != -1) {
+    switch (opt) {
+    case 'n':
+      analyse_only = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: m65fdisk-replay [-n] trace [image]\n");
+      exit(-1);
+    }
+  }
+  if (argc <= optind) {
+    fprintf(stderr, "usage: m65fdisk-replay [-n] trace [image]\n");
+    exit(-1);
+  }
+
+  load_trace(argv[optind]);
+  end = analyse();
+  if (analyse_only)
+    return 0;
+
+  // Big enough for every sector in the trace, but no smaller than the HAL accepts
+  sdcard_path = argc > optind + 1 ? argv[optind + 1] : "/dev/shm/m65fdisk-replay.img";
+  sdcard_size_override = (uint64_t)(end > 8 * 2048 ? end : 8 * 2048) * 512;
+  sdcard_open();
+  sdcard_getsize();
+  replay();
+
+  return 0;
+}
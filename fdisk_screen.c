@@ -13,8 +13,11 @@
 extern unsigned char *charset;
 
 long screen_line_address = SCREEN_ADDRESS;
+unsigned int screen_top = SCREEN_ADDRESS;
 char screen_column = 0;
 
+#define colour_address(A) (COLOUR_RAM_ADDRESS - SCREEN_ADDRESS + (A))
+
 #ifdef __CC65__
 unsigned char *footer_messages[FOOTER_MAX + 1] = {
   " MEGA65 FDISK+FORMAT V00.24 : (C) COPYRIGHT 2017-2022 PAUL GARDNER-STEPHEN ETC. ",
@@ -50,11 +53,11 @@ void screen_hex(unsigned int addr, long value)
   POKE(addr + 7, to_screen_hex(value >> 0));
 }
 
-void format_hex(const int addr, const long value, const char columns)
+void format_hex(const unsigned int addr, const long value, const char columns)
 {
   char i, c;
   char dec[9];
-  screen_hex((int)&dec[0], value);
+  screen_hex((unsigned int)&dec[0], value);
 
   c = 8 - columns;
   while (c) {
@@ -68,26 +71,60 @@ void format_hex(const int addr, const long value, const char columns)
 }
 #endif
 
-unsigned char screen_decimal_digits[16][5] = { { 0, 0, 0, 0, 1 }, { 0, 0, 0, 0, 2 }, { 0, 0, 0, 0, 4 }, { 0, 0, 0, 0, 8 },
-  { 0, 0, 0, 1, 6 }, { 0, 0, 0, 3, 2 }, { 0, 0, 0, 6, 4 }, { 0, 0, 1, 2, 8 }, { 0, 0, 2, 5, 6 }, { 0, 0, 5, 1, 2 },
-  { 0, 1, 0, 2, 4 }, { 0, 2, 0, 4, 8 }, { 0, 4, 0, 9, 6 }, { 0, 8, 1, 9, 2 }, { 1, 6, 3, 8, 4 }, { 3, 2, 7, 6, 8 } };
+#ifdef __CC65__
+static void show_screen_top(void)
+{
+  // Point the VIC-IV at the visible part of the screen and colour RAM strips
+  POKE(0xD060U, screen_top & 0xff);
+  POKE(0xD061U, screen_top >> 8);
+  POKE(0xD062U, 0);
+  POKE(0xD063U, PEEK(0xD063U) & 0xf0);
+  POKE(0xD064U, (colour_address(screen_top) - 0xff80000L) & 0xff);
+  POKE(0xD065U, (colour_address(screen_top) - 0xff80000L) >> 8);
+}
 
-void write_line(char *s, char col)
+static void queue_scroll(void)
+{
+  if (screen_top + 26 * 80 > SCREEN_ADDRESS + SCREEN_ROWS * 80) {
+    // End of the strip: move the rows that stay visible back to its start
+    dma_chain_copy(screen_top + 80, SCREEN_ADDRESS, 23 * 80);
+    dma_chain_copy(colour_address(screen_top + 80), colour_address(SCREEN_ADDRESS), 23 * 80);
+    dma_chain_copy(FOOTER_ADDRESS, SCREEN_ADDRESS + 24 * 80, 80);
+    dma_chain_copy(colour_address(FOOTER_ADDRESS), colour_address(SCREEN_ADDRESS + 24 * 80), 80);
+    screen_top = SCREEN_ADDRESS;
+  }
+  else {
+    // Move the footer down a line, and show one line further down
+    dma_chain_copy(FOOTER_ADDRESS, FOOTER_ADDRESS + 80, 80);
+    dma_chain_copy(colour_address(FOOTER_ADDRESS), colour_address(FOOTER_ADDRESS + 80), 80);
+    screen_top += 80;
+  }
+  // Clear the new bottom line
+  dma_chain_fill(screen_top + 23 * 80, ' ', 80);
+  dma_chain_fill(colour_address(screen_top + 23 * 80), 1, 80);
+  screen_line_address = screen_top + 23 * 80;
+}
+
+static void queue_write_line(char *s, char col)
 {
-#ifdef __CC65__
   char len = 0;
   while (s[len])
     len++;
   if (len)
-    lcopy((long)&s[0], screen_line_address + col, len);
+    dma_chain_copy((long)&s[0], screen_line_address + col, len);
   screen_line_address += 80;
-  if ((screen_line_address - SCREEN_ADDRESS) >= (24 * 80)) {
-    screen_line_address -= 80;
-    lcopy(SCREEN_ADDRESS + 80, SCREEN_ADDRESS, 23 * 80);
-    lcopy(COLOUR_RAM_ADDRESS + 80, COLOUR_RAM_ADDRESS, 23 * 80);
-    lfill(SCREEN_ADDRESS + 23 * 80, ' ', 80);
-    lfill(COLOUR_RAM_ADDRESS + 23 * 80, 1, 80);
-  }
+  if ((screen_line_address - screen_top) >= (24 * 80))
+    queue_scroll();
+}
+#endif
+
+// The text, and the scroll if the screen is full, go out as one DMA list
+void write_line(char *s, char col)
+{
+#ifdef __CC65__
+  queue_write_line(s, col);
+  dma_chain_submit();
+  show_screen_top();
 #else
   for (int i = 0; i < col; i++)
     fprintf(stdout, " ");
@@ -95,71 +132,94 @@ void write_line(char *s, char col)
 #endif
 }
 
+// As write_line(), with the whole line in <colour>, all in one DMA list
+void write_line_colour(char *s, char col, char colour)
+{
+#ifdef __CC65__
+  dma_chain_fill(colour_address(screen_line_address), colour, 80);
+  queue_write_line(s, col);
+  dma_chain_submit();
+  show_screen_top();
+#else
+  write_line(s, col);
+#endif
+}
+
 #ifdef __CC65__
 void recolour_last_line(char colour)
 {
-  long colour_address = COLOUR_RAM_ADDRESS + (screen_line_address - SCREEN_ADDRESS) - 80;
-  lfill(colour_address, colour, 80);
+  lfill(colour_address(screen_line_address - 80), colour, 80);
   return;
 }
 
-unsigned char ii, j, carry, temp;
-unsigned int value;
-void screen_decimal(unsigned int addr, unsigned int v)
-{
-  value = v;
-
-  // Start with all zeros
-  for (ii = 0; ii < 5; ii++)
-    screen_hex_buffer[ii] = 0;
-
-  // Add power of two strings for all non-zero bits in value.
-  // XXX - We should use BCD mode to do this more efficiently
-  for (ii = 0; ii < 16; ii++) {
-    if (value & 1) {
-      carry = 0;
-      for (j = 4; j < 128; j--) {
-        temp = screen_hex_buffer[j] + screen_decimal_digits[ii][j] + carry;
-        if (temp > 9) {
-          temp -= 10;
-          carry = 1;
-        }
-        else
-          carry = 0;
-        screen_hex_buffer[j] = temp;
-      }
-    }
-    value = value >> 1;
-  }
+// 10 BCD digits, most significant first, and the value they are made from
+unsigned char decimal_bcd[5];
+unsigned long decimal_value;
+// The digits of the last value formatted, then spaces
+unsigned char decimal_buffer[10];
 
-  // Now convert to ascii digits
-  for (j = 0; j < 5; j++)
-    screen_hex_buffer[j] = screen_hex_buffer[j] | '0';
-
-  // and shift out leading zeros
-  for (j = 0; j < 4; j++) {
-    if (screen_hex_buffer[0] != '0')
-      break;
-    screen_hex_buffer[0] = screen_hex_buffer[1];
-    screen_hex_buffer[1] = screen_hex_buffer[2];
-    screen_hex_buffer[2] = screen_hex_buffer[3];
-    screen_hex_buffer[3] = screen_hex_buffer[4];
-    screen_hex_buffer[4] = ' ';
+static unsigned char decimal_format(unsigned long v)
+{
+  // Returns the number of digits in decimal_buffer[]
+  unsigned char i, d, digits;
+
+  decimal_value = v;
+  for (i = 0; i < 5; i++)
+    decimal_bcd[i] = 0;
+
+  // Double dabble, with the CPU's decimal mode doing the adjusting: shift the
+  // value out MSB first, and double the BCD number plus that bit.
+  __asm__("ldx #32");
+next_bit:
+  __asm__("asl %v", decimal_value);
+  __asm__("rol %v+1", decimal_value);
+  __asm__("rol %v+2", decimal_value);
+  __asm__("rol %v+3", decimal_value);
+  __asm__("sed");
+  __asm__("lda %v+4", decimal_bcd);
+  __asm__("adc %v+4", decimal_bcd);
+  __asm__("sta %v+4", decimal_bcd);
+  __asm__("lda %v+3", decimal_bcd);
+  __asm__("adc %v+3", decimal_bcd);
+  __asm__("sta %v+3", decimal_bcd);
+  __asm__("lda %v+2", decimal_bcd);
+  __asm__("adc %v+2", decimal_bcd);
+  __asm__("sta %v+2", decimal_bcd);
+  __asm__("lda %v+1", decimal_bcd);
+  __asm__("adc %v+1", decimal_bcd);
+  __asm__("sta %v+1", decimal_bcd);
+  __asm__("lda %v", decimal_bcd);
+  __asm__("adc %v", decimal_bcd);
+  __asm__("sta %v", decimal_bcd);
+  __asm__("cld");
+  __asm__("dex");
+  __asm__("bne %g", next_bit);
+
+  // Unpack the digits without leading zeros, keeping at least one
+  digits = 0;
+  for (i = 0; i < 10; i++) {
+    d = (i & 1) ? decimal_bcd[i >> 1] & 0xf : decimal_bcd[i >> 1] >> 4;
+    if (d || digits || i == 9)
+      decimal_buffer[digits++] = '0' + d;
   }
-
-  // Copy to screen
-  for (j = 0; j < 5; j++)
-    POKE(addr + j, screen_hex_buffer[j]);
+  for (i = digits; i < 10; i++)
+    decimal_buffer[i] = ' ';
+  return digits;
 }
 
-void format_decimal(const int addr, const int value, const char columns)
+unsigned char screen_decimal(unsigned int addr, unsigned long value)
 {
-  char i;
-  char dec[6];
-  screen_decimal((int)&dec[0], value);
+  // Write <value> at <addr>, padded with spaces to at least 5 columns,
+  // and return the number of digits
+  unsigned char digits = decimal_format(value);
+  lcopy((long)decimal_buffer, addr, digits < 5 ? 5 : digits);
+  return digits;
+}
 
-  for (i = 0; i < columns; i++)
-    lpoke(addr + i, dec[i]);
+void format_decimal(const unsigned int addr, const unsigned long value, const char columns)
+{
+  decimal_format(value);
+  lcopy((long)decimal_buffer, addr, columns);
 }
 
 long addr;
@@ -175,6 +235,32 @@ void display_footer(unsigned char index)
 void setup_screen(void)
 {
 }
+
+// There is no memory mapped screen on the host, so screen pokes are dropped
+void screen_hex(unsigned int addr, long value)
+{
+}
+
+void screen_hex_byte(unsigned int addr, long value)
+{
+}
+
+unsigned char screen_decimal(unsigned int addr, unsigned long value)
+{
+  return 0;
+}
+
+void format_decimal(const unsigned int addr, const unsigned long value, const char columns)
+{
+}
+
+void format_hex(const unsigned int addr, const long value, const char columns)
+{
+}
+
+void recolour_last_line(char colour)
+{
+}
 #else
 void setup_screen(void)
 {
@@ -185,9 +271,8 @@ void setup_screen(void)
   // 80-column mode, fast CPU, extended attributes enable
   *((unsigned char *)0xD031) = 0xe0;
 
-  // Put screen memory somewhere (2KB required)
-  // We are using $8000-$87FF for screen
-  // Using custom charset @ $A000
+  // Custom charset @ $8800. The screen strip follows at $9000-$BFCF, and
+  // show_screen_top() points the VIC-IV at the visible part of it.
   *(unsigned char *)0xD018U = (((CHARSET_ADDRESS - 0x8000U) >> 11) << 1) + (((SCREEN_ADDRESS - 0x8000U) >> 10) << 4);
 
   // VIC RAM Bank to $8000-$BFFF
@@ -207,16 +292,18 @@ void setup_screen(void)
   // XXX For some reason in this mode its still one pixel out, so move it two
   POKE(0xD016, 0xC9);
 
-  // Clear screen RAM
-  lfill(SCREEN_ADDRESS, 0x20, 2000);
+  // Clear the screen RAM strip
+  lfill(SCREEN_ADDRESS, 0x20, SCREEN_ROWS * 80);
 
-  // Clear colour RAM: white text
-  lfill(0x1f800, 0x01, 2000);
+  // Clear the colour RAM strip: white text
+  lfill(COLOUR_RAM_ADDRESS, 0x01, SCREEN_ROWS * 80);
 
   // Copy ASCII charset into place
   lcopy((int)&charset[0], CHARSET_ADDRESS, 0x800);
 
-  // Set screen line address and write point
+  // Set screen line address and write point, at the start of the strip
+  screen_top = SCREEN_ADDRESS;
+  show_screen_top();
   screen_line_address = SCREEN_ADDRESS;
   screen_column = 0;
 
@@ -227,7 +314,7 @@ void screen_colour_line(unsigned char line, unsigned char colour)
 {
   // Set colour RAM for this screen line to this colour
   // (use bit-shifting as fast alternative to multiply)
-  lfill(0x1f800 + (line << 6) + (line << 4), colour, 80);
+  lfill(colour_address(screen_top + (line << 6) + (line << 4)), colour, 80);
 }
 #endif
 
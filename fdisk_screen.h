@@ -1,7 +1,13 @@
-#define SCREEN_ADDRESS (0x8000U)
+// The console scrolls by moving the VIC-IV screen and colour RAM pointers
+// down a strip of SCREEN_ROWS rows, starting at screen_top. Only the new
+// bottom line and the footer are written per scroll. When the strip runs
+// out, the visible rows are copied back to its start.
+#define SCREEN_ADDRESS (0x9000U)
+#define SCREEN_ROWS 153
 #define CHARSET_ADDRESS (0x8800U)
-#define COLOUR_RAM_ADDRESS (0x1f800)
-#define FOOTER_ADDRESS (SCREEN_ADDRESS + 24 * 80)
+// The strip's colour RAM, after the first 2KB that $D800 shows
+#define COLOUR_RAM_ADDRESS (0xff80800L)
+#define FOOTER_ADDRESS (screen_top + 24 * 80)
 
 #define FOOTER_COPYRIGHT 0
 #define FOOTER_BLANK 1
@@ -42,20 +48,22 @@ void footer_restore(void);
 void display_buffer_position_footer(char bid);
 
 void screen_colour_line(unsigned char line, unsigned char colour);
-#define screen_colour_line_segment(LA, W, C) lfill(LA + (0x1f800 - SCREEN_ADDRESS), C, W)
+#define screen_colour_line_segment(LA, W, C) lfill(LA + (COLOUR_RAM_ADDRESS - SCREEN_ADDRESS), C, W)
 
 void screen_hex(unsigned int addr, long value);
 void screen_hex_byte(unsigned int addr, long value);
-void screen_decimal(unsigned int addr, unsigned int value);
+unsigned char screen_decimal(unsigned int addr, unsigned long value);
 void set_screen_attributes(long p, unsigned char count, unsigned char attr);
 void write_line(char *s, char col);
+void write_line_colour(char *s, char col, char colour);
 void recolour_last_line(char colour);
 char read_line(char *buffer, unsigned char maxlen);
 
-void format_decimal(const int addr, const int value, const char columns);
-void format_hex(const int addr, const long value, const char columns);
+void format_decimal(const unsigned int addr, const unsigned long value, const char columns);
+void format_hex(const unsigned int addr, const long value, const char columns);
 
 extern long screen_line_address;
+extern unsigned int screen_top;
 
 extern unsigned char ascii_map[256];
 #define ascii_to_screen(X) ascii_map[X]
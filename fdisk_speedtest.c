@@ -0,0 +1,160 @@
+/*
+  SD card benchmarks, shared by the MEGA65 and the host.
+
+  All timing uses timer_read_us(): the cascaded CIA2 timers on the MEGA65,
+  and clock_gettime() on the host.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_memory.h"
+#include "fdisk_screen.h"
+#include "fdisk_speedtest.h"
+
+// Operations for the single sector tests
+#define BENCH_OPS 256
+// Sectors per multi-sector write (from POPULATE_BUFFER) and per erase
+#define BENCH_RUN POPULATE_SECTORS
+#define ERASE_RUN 64
+
+static uint32_t op_start, op_min, op_max, op_total, op_sectors;
+static uint16_t op_count;
+
+static void bench_begin(void)
+{
+  op_min = 0xffffffffUL;
+  op_max = 0;
+  op_total = 0;
+  op_sectors = 0;
+  op_count = 0;
+}
+
+static void op_begin(void)
+{
+  op_start = timer_read_us();
+}
+
+static void op_end(const uint16_t sectors)
+{
+  uint32_t t = timer_read_us() - op_start;
+
+  if (t < op_min)
+    op_min = t;
+  if (t > op_max)
+    op_max = t;
+  op_total += t;
+  op_sectors += sectors;
+  op_count++;
+}
+
+#ifdef __CC65__
+static void bench_decimal(const long addr, const uint32_t value)
+{
+  // The columns are 10 apart
+  screen_decimal(addr, value > 99999UL ? 99999UL : value);
+}
+#endif
+
+static void bench_report(const char *name)
+{
+  uint32_t avg = op_count ? op_total / op_count : 0;
+#ifdef __CC65__
+  // KB/sec = bytes * 1000 / usec. No test moves more than 1MiB, so this
+  // does not overflow.
+  uint32_t kb_per_sec = op_total ? ((op_sectors << 9) * 1000) / op_total : 0;
+  char line[80];
+
+  strcpy(line, "                min       avg       max       usec      .   MB/sec");
+  memcpy(line, name, strlen(name));
+  write_line(line, 1);
+  bench_decimal(screen_line_address - 80 + 1 + 20, op_min);
+  bench_decimal(screen_line_address - 80 + 1 + 30, avg);
+  bench_decimal(screen_line_address - 80 + 1 + 40, op_max);
+  bench_decimal(screen_line_address - 80 + 1 + 51, kb_per_sec / 1000);
+  lpoke(screen_line_address - 80 + 1 + 57, '0' + (kb_per_sec % 1000) / 100);
+  lpoke(screen_line_address - 80 + 1 + 58, '0' + (kb_per_sec % 100) / 10);
+#else
+  // MB/sec is the same as bytes/usec
+  printf(" %-16s min %8u avg %8u max %8u usec %8.2f MB/sec\n", name, op_min, avg, op_max,
+      op_total ? op_sectors * 512.0 / op_total : 0.0);
+#endif
+}
+
+unsigned char sdcard_benchmark_allowed(const uint8_t *partition_table)
+{
+  const uint8_t *entry;
+  uint32_t start;
+  unsigned char i;
+
+  // Without a partition table, there is nothing we know of to protect
+  if (partition_table[0x40] != 0x55 || partition_table[0x41] != 0xaa)
+    return 1;
+  for (i = 0; i < 4; i++) {
+    entry = &partition_table[i << 4];
+    start = entry[8] | ((uint32_t)entry[9] << 8) | ((uint32_t)entry[10] << 16) | ((uint32_t)entry[11] << 24);
+    // A GPT protective partition (type $EE) starts at sector 1
+    if (entry[4] && start < BENCH_SCRATCH_FIRST + BENCH_SCRATCH_SECTORS)
+      return 0;
+  }
+  return 1;
+}
+
+void sdcard_benchmark(const uint32_t card_sectors)
+{
+  uint32_t n, r;
+  uint16_t count;
+
+  write_line("", 0);
+  write_line("SD card benchmark (overwrites sectors 1 - $7FF):", 1);
+
+  bench_begin();
+  for (n = 0; n < BENCH_OPS; n++) {
+    op_begin();
+    sdcard_readsector(n);
+    op_end(1);
+  }
+  bench_report("Sequential read");
+
+  // Simple LCG, so that every run probes the same sectors
+  bench_begin();
+  r = 1;
+  for (n = 0; n < BENCH_OPS; n++) {
+    r = r * 1103515245UL + 12345;
+    op_begin();
+    sdcard_readsector((r >> 4) % card_sectors);
+    op_end(1);
+  }
+  bench_report("Random read");
+
+  // Different contents every time, so that no write can be skipped
+  bench_begin();
+  for (n = 0; n < BENCH_OPS; n++) {
+    lfill((long)sector_buffer, n | 1, 512);
+    op_begin();
+    sdcard_writesector(BENCH_SCRATCH_FIRST + n);
+    op_end(1);
+  }
+  bench_report("1 sector write");
+
+  bench_begin();
+  lfill(POPULATE_BUFFER, 0x5a, BENCH_RUN * 512);
+  for (n = 0; n < BENCH_SCRATCH_SECTORS; n += count) {
+    count = BENCH_SCRATCH_SECTORS - n < BENCH_RUN ? BENCH_SCRATCH_SECTORS - n : BENCH_RUN;
+    op_begin();
+    sdcard_writesectors(BENCH_SCRATCH_FIRST + n, POPULATE_BUFFER, count);
+    op_end(count);
+  }
+  bench_report("Multi write");
+
+  // This also leaves the scratch area blank again
+  bench_begin();
+  for (n = 0; n < BENCH_SCRATCH_SECTORS; n += count) {
+    count = BENCH_SCRATCH_SECTORS - n < ERASE_RUN ? BENCH_SCRATCH_SECTORS - n : ERASE_RUN;
+    op_begin();
+    sdcard_erase(BENCH_SCRATCH_FIRST + n, BENCH_SCRATCH_FIRST + n + count - 1);
+    op_end(count);
+  }
+  bench_report("Erase");
+}
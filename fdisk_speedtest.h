@@ -0,0 +1,18 @@
+/*
+  SD card benchmarks: sequential and random reads, single and multi-sector
+  writes, and erases. Each test reports the min/avg/max time per operation
+  and the overall throughput.
+
+  The write and erase tests overwrite sectors 1 - $7FF, between the MBR and
+  the first partition, which the partition layout we create leaves unused.
+  Other layouts (DOS partitions at sector 63, GPT) keep data there, so check
+  with sdcard_benchmark_allowed() first.
+*/
+
+#define BENCH_SCRATCH_FIRST 1
+#define BENCH_SCRATCH_SECTORS 0x7ff
+
+// Whether the MBR partition table (bytes $1BE - $1FF) leaves the scratch
+// sectors unused
+unsigned char sdcard_benchmark_allowed(const uint8_t *partition_table);
+void sdcard_benchmark(const uint32_t card_sectors);
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fdisk_hal.h"
+#include "fdisk_memory.h"
+#include "fdisk_fat32.h"
+#include "fdisk_screen.h"
+#include "fdisk_trace.h"
+
+static struct trace_record trace_rec;
+static uint32_t trace_start;
+static unsigned char trace_paused = 0;
+
+#if !defined(__CC65__) || defined(TRACE)
+void trace_pause(void)
+{
+  trace_paused++;
+}
+
+void trace_resume(void)
+{
+  trace_paused--;
+}
+#endif
+
+#ifdef __CC65__
+#ifdef TRACE
+static uint32_t trace_count = 0;
+
+void trace_op(const uint8_t op, const uint32_t sector, const uint32_t count)
+{
+  if (trace_paused)
+    return;
+  if (!trace_count) {
+    trace_start = timer_read_us();
+    lcopy((long)TRACE_MAGIC, TRACE_ADDRESS, 8);
+  }
+
+  trace_rec.op = op;
+  trace_rec.sector = sector;
+  trace_rec.count = count;
+  trace_rec.time_us = timer_read_us() - trace_start;
+  lcopy((long)&trace_rec, TRACE_ADDRESS + 16 + trace_count * sizeof(trace_rec), sizeof(trace_rec));
+
+  trace_count++;
+  lcopy((long)&trace_count, TRACE_ADDRESS + 8, 4);
+}
+
+void trace_save(const long root_dir_sector, const long fat1_sector, const long fat2_sector)
+{
+  // Copy the trace from attic RAM to FDISK.TRC, without tracing that
+  long size = 16 + trace_count * sizeof(trace_rec);
+  long sector, offset;
+
+  if (!trace_count)
+    return;
+  trace_pause();
+  sector = fat32_create_contiguous_file("FDISK   TRC", size, root_dir_sector, fat1_sector, fat2_sector);
+  if (sector) {
+    for (offset = 0; offset < size; offset += 512) {
+      lcopy(TRACE_ADDRESS + offset, (long)sector_buffer, 512);
+      sdcard_writesector(sector++);
+    }
+    write_line("Saved the sector I/O trace as FDISK.TRC", 1);
+  }
+  else
+    write_line_colour("!! Could not save the sector I/O trace", 1, 2);
+  trace_resume();
+}
+#endif
+#else
+static FILE *trace_file = NULL;
+static uint32_t trace_count = 0;
+
+static void trace_close(void)
+{
+  // Fill in the number of records in the header
+  if (fseek(trace_file, 8, SEEK_SET) || fwrite(&trace_count, 4, 1, trace_file) != 1 || fclose(trace_file))
+    perror("trace");
+  trace_file = NULL;
+}
+
+void trace_open(const char *path)
+{
+  trace_file = fopen(path, "w");
+  if (!trace_file) {
+    fprintf(stderr, "Could not create trace file %s.\n", path);
+    perror("fopen");
+    exit(-1);
+  }
+  fwrite(TRACE_MAGIC "\0\0\0\0\0\0\0\0", 16, 1, trace_file);
+  trace_start = timer_read_us();
+  // Also flushes the trace when we exit() because of an error
+  atexit(trace_close);
+}
+
+void trace_op(const uint8_t op, const uint32_t sector, const uint32_t count)
+{
+  if (!trace_file || trace_paused)
+    return;
+  trace_rec.op = op;
+  trace_rec.sector = sector;
+  trace_rec.count = count;
+  trace_rec.time_us = timer_read_us() - trace_start;
+  fwrite(&trace_rec, sizeof(trace_rec), 1, trace_file);
+  trace_count++;
+}
+#endif
@@ -0,0 +1,55 @@
+/*
+  Trace of the sector I/O requested from the HAL, for offline analysis and
+  replay with m65fdisk-replay.
+
+  A trace is a 16 byte header (TRACE_MAGIC, the number of records as a
+  32-bit value, and 4 reserved bytes) followed by trace_record structures,
+  all little-endian. On the host, use --trace <file>. On the MEGA65, build
+  with -DTRACE (make m65fdisk-trace.prg), and the trace is kept in attic RAM
+  at TRACE_ADDRESS, in the same format. trace_save() then writes it to
+  FDISK.TRC on the card once it has been formatted.
+
+  Reads and writes are recorded as the rest of fdisk asks for them, before
+  the write cache (fdisk_wcache.c) absorbs or serves any of them. What the
+  cache writes out is recorded as one TRACE_FLUSH per run, and the writes
+  and verifies it is made of are left out, as are the single sector
+  fallbacks inside the HAL.
+*/
+
+#define TRACE_MAGIC "M65TRC01"
+
+#define TRACE_READ 'R'   // SD card sectors read
+#define TRACE_WRITE 'W'  // SD card sectors written
+#define TRACE_ERASE 'E'  // SD card sectors erased
+#define TRACE_FLASH 'F'  // Sector read from flash (sector = byte address)
+#define TRACE_VERIFY 'V' // SD card sectors read back to verify them
+#define TRACE_FLUSH 'C'  // Run of cached sectors written (and verified)
+
+struct trace_record {
+  uint8_t op;
+  uint8_t reserved[3];
+  uint32_t sector;
+  uint32_t count;
+  uint32_t time_us; // Since the trace was started
+};
+
+#ifdef __CC65__
+#define TRACE_ADDRESS 0x8000000L
+#ifdef TRACE
+void trace_op(const uint8_t op, const uint32_t sector, const uint32_t count);
+void trace_pause(void);
+void trace_resume(void);
+void trace_save(const long root_dir_sector, const long fat1_sector, const long fat2_sector);
+#else
+#define trace_op(OP, SECTOR, COUNT)
+#define trace_pause()
+#define trace_resume()
+#define trace_save(ROOT_DIR_SECTOR, FAT1_SECTOR, FAT2_SECTOR)
+#endif
+#else
+void trace_open(const char *path);
+void trace_op(const uint8_t op, const uint32_t sector, const uint32_t count);
+// Leave out the operations between these, which nest
+void trace_pause(void);
+void trace_resume(void);
+#endif
@@ -0,0 +1,191 @@
+/*
+  Write-back sector cache.
+
+  The dirty sectors are kept sorted by LBA in wcache_sector[]. The contents
+  of entry i live in slot wcache_slot[i] of WCACHE_BUFFER. wcache_slot[] is
+  always a permutation of all the slots, so the slots of the entries past
+  wcache_count are the free ones.
+
+  When the cache is full, everything is committed, as that gives the longest
+  runs. The commit needs sector_buffer, so the sector being written waits in
+  the spare slot after the cache slots meanwhile. Commits assemble each run
+  of adjacent sectors in FAT_CHAIN_BUFFER with one chained DMA list, and
+  read each run back afterwards, as only single sector writes are verified
+  by the SD card code.
+
+  FAT_CHAIN_BUFFER is otherwise only used by fat32_write_chain(), between
+  filling it and writing and verifying it. The single sector writes of
+  sdcard_writesectors() and sdcard_verifysectors() go through
+  wcache_write_through(), so that never makes the cache flush while the
+  buffer still holds chain data.
+*/
+
+#include "fdisk_hal.h"
+#include "fdisk_memory.h"
+#include "fdisk_trace.h"
+#include "fdisk_wcache.h"
+
+uint32_t wcache_sector[WCACHE_SECTORS];
+unsigned char wcache_slot[WCACHE_SECTORS];
+unsigned char wcache_count = 0;
+unsigned char wcache_active = 0;
+
+uint32_t wcache_writes_absorbed = 0;
+uint32_t wcache_reads_served = 0;
+uint32_t wcache_runs = 0;
+
+static unsigned char wi;
+
+// A full cache can be one run, and it has to fit in FAT_CHAIN_BUFFER
+#if WCACHE_SECTORS > FAT_CHAIN_SECTORS
+#error "WCACHE_SECTORS must not be more than FAT_CHAIN_SECTORS"
+#endif
+
+#define wcache_slot_address(I) (WCACHE_BUFFER + ((long)wcache_slot[I] << 9))
+#define WCACHE_SPARE (WCACHE_BUFFER + ((long)WCACHE_SECTORS << 9))
+
+static unsigned char wcache_find(const uint32_t sector_number)
+{
+  // Index of the first entry at or after <sector_number>
+  for (wi = 0; wi < wcache_count; wi++)
+    if (wcache_sector[wi] >= sector_number)
+      break;
+  return wi;
+}
+
+static void wcache_flush(void)
+{
+  unsigned char i, run;
+
+  // The writes must reach the SD card, not come back here
+  wcache_active = 0;
+
+  for (i = 0; i < wcache_count; i += run) {
+    for (run = 1; i + run < wcache_count; run++)
+      if (wcache_sector[i + run] != wcache_sector[i] + run)
+        break;
+    // The writes were traced as they came into the cache
+    trace_op(TRACE_FLUSH, wcache_sector[i], run);
+    trace_pause();
+    if (run == 1) {
+      lcopy(wcache_slot_address(i), (long)sector_buffer, 512);
+      sdcard_writesector(wcache_sector[i]);
+    }
+    else {
+      for (wi = 0; wi < run; wi++)
+        dma_chain_copy(wcache_slot_address(i + wi), FAT_CHAIN_BUFFER + ((long)wi << 9), 512);
+      dma_chain_submit();
+      sdcard_writesectors(wcache_sector[i], FAT_CHAIN_BUFFER, run);
+      sdcard_verifysectors(wcache_sector[i], FAT_CHAIN_BUFFER, run);
+    }
+    trace_resume();
+    wcache_runs++;
+  }
+  wcache_count = 0;
+
+  wcache_active = 1;
+}
+
+void wcache_begin(void)
+{
+  for (wi = 0; wi < WCACHE_SECTORS; wi++)
+    wcache_slot[wi] = wi;
+  wcache_count = 0;
+  wcache_active = 1;
+}
+
+void wcache_commit(void)
+{
+  if (!wcache_active)
+    return;
+  wcache_flush();
+  wcache_active = 0;
+}
+
+unsigned char wcache_write(const uint32_t sector_number)
+{
+  unsigned char i, slot;
+
+  if (!wcache_active)
+    return 0;
+
+  i = wcache_find(sector_number);
+  if (i < wcache_count && wcache_sector[i] == sector_number)
+    wcache_writes_absorbed++;
+  else {
+    if (wcache_count == WCACHE_SECTORS) {
+      lcopy((long)sector_buffer, WCACHE_SPARE, 512);
+      wcache_flush();
+      lcopy(WCACHE_SPARE, (long)sector_buffer, 512);
+      i = 0;
+    }
+    // Take the first free slot, and open a gap for it at i
+    slot = wcache_slot[wcache_count];
+    for (wi = wcache_count; wi > i; wi--) {
+      wcache_sector[wi] = wcache_sector[wi - 1];
+      wcache_slot[wi] = wcache_slot[wi - 1];
+    }
+    wcache_sector[i] = sector_number;
+    wcache_slot[i] = slot;
+    wcache_count++;
+  }
+  lcopy((long)sector_buffer, wcache_slot_address(i), 512);
+  return 1;
+}
+
+unsigned char wcache_read(const uint32_t sector_number)
+{
+  unsigned char i;
+
+  if (!wcache_active)
+    return 0;
+
+  i = wcache_find(sector_number);
+  if (i == wcache_count || wcache_sector[i] != sector_number)
+    return 0;
+  lcopy(wcache_slot_address(i), (long)sector_buffer, 512);
+  wcache_reads_served++;
+  return 1;
+}
+
+void wcache_drop(const uint32_t first_sector, const uint32_t last_sector)
+{
+  unsigned char i, j, slot;
+
+  if (!wcache_active)
+    return;
+
+  i = wcache_find(first_sector);
+  while (i < wcache_count && wcache_sector[i] <= last_sector) {
+    // Close the gap, and hand the slot back to the free ones
+    slot = wcache_slot[i];
+    wcache_count--;
+    for (j = i; j < wcache_count; j++) {
+      wcache_sector[j] = wcache_sector[j + 1];
+      wcache_slot[j] = wcache_slot[j + 1];
+    }
+    wcache_slot[wcache_count] = slot;
+  }
+}
+
+void wcache_write_through(const uint32_t sector_number)
+{
+  unsigned char active = wcache_active;
+
+  // Part of an operation that has been traced already
+  trace_pause();
+  wcache_active = 0;
+  sdcard_writesector(sector_number);
+  wcache_active = active;
+  trace_resume();
+}
+
+void wcache_flush_range(const uint32_t first_sector, const uint32_t last_sector)
+{
+  if (!wcache_active)
+    return;
+
+  wi = wcache_find(first_sector);
+  if (wi < wcache_count && wcache_sector[wi] <= last_sector)
+    wcache_flush();
+}
@@ -0,0 +1,30 @@
+/*
+  Write-back cache for single sector writes (sdcard_writesector()), so that
+  sectors that are written again and again while formatting and populating
+  (FSInfo, directory and FAT sectors) only reach the SD card once, and
+  neighbouring sectors go out together as multi-sector writes.
+
+  Nothing is cached until wcache_begin(). wcache_commit() writes all dirty
+  sectors in LBA order, and stops caching until the next wcache_begin().
+  The HALs call the other functions, to keep the cache coherent with the
+  reads, multi-sector writes and erases that bypass it.
+*/
+
+void wcache_begin(void);
+void wcache_commit(void);
+// Returns 1 if the write of sector_buffer to <sector_number> was absorbed
+unsigned char wcache_write(const uint32_t sector_number);
+// Returns 1 if <sector_number> was read into sector_buffer from the cache
+unsigned char wcache_read(const uint32_t sector_number);
+// first_sector..last_sector are about to be overwritten by other means
+void wcache_drop(const uint32_t first_sector, const uint32_t last_sector);
+// first_sector..last_sector are about to be read from the SD card
+void wcache_flush_range(const uint32_t first_sector, const uint32_t last_sector);
+// Write sector_buffer to <sector_number> on the SD card now, for writes that
+// must not be deferred (fallbacks of multi-sector writes, rewrites after a
+// failed verify). The caller has already dropped the sector from the cache.
+void wcache_write_through(const uint32_t sector_number);
+
+extern uint32_t wcache_writes_absorbed; // Writes to sectors that were already dirty
+extern uint32_t wcache_reads_served;
+extern uint32_t wcache_runs; // Runs of adjacent sectors written by commits